@@ -0,0 +1,115 @@
+#pragma once
+
+#include "types.h"
+
+// Decoders for the few A64 instructions analysis passes look for. Each
+// returns false if |insn| is not that instruction.
+namespace A64 {
+
+enum Extend { kUxtb, kUxth, kUxtw, kUxtx, kSxtb, kSxth, kSxtw, kSxtx };
+
+enum Cond { kEq, kNe, kHs, kLo, kMi, kPl, kVs, kVc, kHi, kLs };
+
+inline s64 SignExtend(u64 val, int bits) {
+  return static_cast<s64>(val << (64 - bits)) >> (64 - bits);
+}
+inline u32 Rd(u32 insn) { return insn & 31; }
+inline u32 Rn(u32 insn) { return (insn >> 5) & 31; }
+inline u32 Rm(u32 insn) { return (insn >> 16) & 31; }
+
+// BR Xn
+inline bool IsBr(u32 insn) { return (insn & 0xfffffc1f) == 0xd61f0000; }
+inline bool IsRet(u32 insn) { return (insn & 0xfffffc1f) == 0xd65f0000; }
+// B / BL imm26
+inline bool IsB(u32 insn) { return (insn & 0x7c000000) == 0x14000000; }
+inline bool IsBl(u32 insn) { return (insn & 0xfc000000) == 0x94000000; }
+inline u64 BTarget(u32 insn, u64 pc) {
+  return pc + (SignExtend(insn & 0x3ffffff, 26) << 2);
+}
+
+// B.cond imm19
+inline bool IsBCond(u32 insn, Cond* cond) {
+  if ((insn & 0xff000010) != 0x54000000) {
+    return false;
+  }
+  *cond = static_cast<Cond>(insn & 0xf);
+  return true;
+}
+
+// ADR / ADRP Xd, label: *value is the address loaded into Xd
+inline bool IsAdr(u32 insn, u64 pc, u64* value) {
+  u64 imm = ((insn >> 3) & 0x1ffffc) | ((insn >> 29) & 3);
+  if ((insn & 0x9f000000) == 0x10000000) {
+    *value = pc + SignExtend(imm, 21);
+    return true;
+  }
+  if ((insn & 0x9f000000) == 0x90000000) {
+    *value = (pc & ~0xfffull) + (SignExtend(imm, 21) << 12);
+    return true;
+  }
+  return false;
+}
+
+// ADD Xd, Xn, #imm{, lsl #12}
+inline bool IsAddImm(u32 insn, u64* imm) {
+  if ((insn & 0xff800000) != 0x91000000) {
+    return false;
+  }
+  *imm = static_cast<u64>((insn >> 10) & 0xfff) << ((insn >> 22) & 1 ? 12 : 0);
+  return true;
+}
+
+// ADD Xd, Xn, Rm, <extend> #shift, or ADD Xd, Xn, Xm, lsl #shift
+inline bool IsAddReg(u32 insn, Extend* extend, u32* shift) {
+  if ((insn & 0xffe00000) == 0x8b200000) {
+    *extend = static_cast<Extend>((insn >> 13) & 7);
+    *shift = (insn >> 10) & 7;
+    return *shift <= 4;
+  }
+  if ((insn & 0xffe00000) == 0x8b000000) {
+    *extend = kUxtx;
+    *shift = (insn >> 10) & 63;
+    return true;
+  }
+  return false;
+}
+
+// LDR{B,H,SB,SH,SW,} Rt, [Xn, Rm{, <extend> {#shift}}]: *size is the access
+// size in bytes
+inline bool IsLdrReg(u32 insn, u32* size, bool* is_signed) {
+  if ((insn & 0x3f200c00) != 0x38200800) {
+    return false;
+  }
+  u32 opc = (insn >> 22) & 3;
+  *size = 1u << (insn >> 30);
+  *is_signed = opc >= 2;
+  // opc 0 is a store; 64 bit signed loads don't exist
+  return opc != 0 && !(*size == 8 && opc != 1) && !(*size == 4 && opc == 3);
+}
+
+// CMP Rn, #imm (SUBS with the zero register as destination)
+inline bool IsCmpImm(u32 insn, u64* imm) {
+  if ((insn & 0x7f80001f) != 0x7100001f) {
+    return false;
+  }
+  *imm = static_cast<u64>((insn >> 10) & 0xfff) << ((insn >> 22) & 1 ? 12 : 0);
+  return true;
+}
+
+// MOV Rd, Rm (ORR Rd, ZR, Rm)
+inline bool IsMovReg(u32 insn) { return (insn & 0x7fe0ffe0) == 0x2a0003e0; }
+
+// Whether bits 0-4 of |insn| are not a destination register: stores,
+// branches and system instructions. Anything else is assumed to write Rd when
+// looking back for the instruction which sets a register.
+inline bool KeepsRd(u32 insn) {
+  // Load/store class with opc == 0 (store) or STP
+  if ((insn & 0x0a000000) == 0x08000000) {
+    bool pair = (insn & 0x3a000000) == 0x28000000;
+    return pair ? !(insn & (1 << 22)) : !(insn & (3 << 22));
+  }
+  // Branches, exception generation and system instructions
+  return (insn & 0x1c000000) == 0x14000000;
+}
+
+}  // namespace A64
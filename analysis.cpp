@@ -0,0 +1,165 @@
+#include "analysis.h"
+
+#include <cstdio>
+#include <set>
+
+#include "parallel.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#endif
+
+PassRegistry& PassRegistry::Get() {
+  static PassRegistry registry;
+  return registry;
+}
+
+bool PassRegistry::LoadPlugin(const char* path) {
+#if defined(NX2ELF_STATIC)
+  fprintf(stderr, "cannot load plugin %s: static build\n", path);
+  return false;
+#else
+#ifdef _WIN32
+  auto handle = LoadLibraryA(path);
+  auto entry = handle ? reinterpret_cast<RegisterPassesFn>(
+                            GetProcAddress(handle, NX2ELF_PLUGIN_ENTRY))
+                      : nullptr;
+#else
+  auto handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+  if (!handle) {
+    fprintf(stderr, "failed to load plugin: %s\n", dlerror());
+    return false;
+  }
+  auto entry =
+      reinterpret_cast<RegisterPassesFn>(dlsym(handle, NX2ELF_PLUGIN_ENTRY));
+#endif
+  if (!entry) {
+    fprintf(stderr, "plugin %s has no " NX2ELF_PLUGIN_ENTRY "\n", path);
+    return false;
+  }
+  // Plugins stay loaded until exit, since their passes live in the registry.
+  size_t first = passes.size();
+  entry(this);
+  for (size_t i = first; i < passes.size(); i++) {
+    overrides.emplace(passes[i]->Name(), true);
+  }
+  return true;
+#endif
+}
+
+bool PassRegistry::Select(const char* list) {
+  std::string names(list);
+  size_t pos = 0;
+  while (pos <= names.size()) {
+    size_t end = names.find(',', pos);
+    if (end == std::string::npos) {
+      end = names.size();
+    }
+    auto name = names.substr(pos, end - pos);
+    pos = end + 1;
+    bool enable = true;
+    if (!name.empty() && name[0] == '-') {
+      enable = false;
+      name.erase(0, 1);
+    }
+    if (name.empty()) {
+      continue;
+    }
+    if (name == "all" || name == "none") {
+      all = name == "all";
+      none = !all;
+      overrides.clear();
+    } else if (Find(name)) {
+      overrides[name] = enable;
+    } else {
+      fprintf(stderr, "unknown pass: %s\n", name.c_str());
+      return false;
+    }
+  }
+  return true;
+}
+
+bool PassRegistry::IsEnabled(const AnalysisPass& pass) const {
+  auto it = overrides.find(pass.Name());
+  if (it != overrides.end()) {
+    return it->second;
+  }
+  if (all || none) {
+    return all;
+  }
+  return pass.DefaultEnabled();
+}
+
+void PassRegistry::Run(const ImageView& view,
+                       unsigned jobs,
+                       PassResults* results) const {
+  // Enabled passes plus everything they depend on
+  std::vector<AnalysisPass*> pending;
+  std::set<std::string> scheduled;
+  std::function<void(AnalysisPass*)> schedule = [&](AnalysisPass* pass) {
+    if (!scheduled.insert(pass->Name()).second) {
+      return;
+    }
+    for (auto& dep : pass->Dependencies()) {
+      if (auto dep_pass = Find(dep)) {
+        schedule(dep_pass);
+      }
+    }
+    pending.push_back(pass);
+  };
+  for (auto& pass : passes) {
+    if (IsEnabled(*pass)) {
+      schedule(pass.get());
+    }
+  }
+  // Create every result up-front so passes running concurrently never
+  // modify the map.
+  for (auto pass : pending) {
+    (*results)[pass->Name()] = {};
+  }
+
+  std::set<std::string> done;
+  while (!pending.empty()) {
+    std::vector<AnalysisPass*> ready;
+    for (auto it = pending.begin(); it != pending.end();) {
+      auto deps = (*it)->Dependencies();
+      bool runnable = true;
+      for (auto& dep : deps) {
+        runnable &= done.count(dep) != 0 || !scheduled.count(dep);
+      }
+      if (runnable) {
+        ready.push_back(*it);
+        it = pending.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    if (ready.empty()) {
+      fputs("error: cyclic analysis pass dependencies\n", stderr);
+      return;
+    }
+    unsigned pass_jobs =
+        std::max(1u, jobs / static_cast<unsigned>(ready.size()));
+    ParallelFor(ready.size(), jobs, [&](size_t i) {
+      auto pass = ready[i];
+      auto& result = results->at(pass->Name());
+      PassContext ctx{view, pass_jobs, results};
+      result.ok = true;
+      for (auto& dep : pass->Dependencies()) {
+        if (!ctx.Find(dep.c_str())) {
+          fprintf(stderr, "pass %s: dependency %s unavailable\n",
+                  pass->Name(), dep.c_str());
+          result.ok = false;
+        }
+      }
+      if (result.ok) {
+        result.ok = pass->Run(ctx, &result);
+      }
+    });
+    for (auto pass : ready) {
+      done.insert(pass->Name());
+    }
+  }
+}
@@ -0,0 +1,209 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "elf.h"
+#include "types.h"
+
+// Read-only view of a loaded module handed to analysis passes. All pointers
+// and counts have been checked to lie within the image.
+struct ImageView {
+  enum SegmentType { kText, kRodata, kData, kNumSegment };
+  struct Segment {
+    u64 addr;
+    u64 size;
+    // Only non-zero for kData
+    u64 bss_size;
+  };
+
+  bool Contains(u64 vaddr, u64 len) const {
+    return vaddr <= image_size && len <= image_size - vaddr;
+  }
+  // Returns a pointer to count objects at vaddr, or nullptr if they would
+  // extend past the image.
+  template <typename T>
+  const T* Ptr(u64 vaddr, size_t count = 1) const {
+    if (count > image_size / sizeof(T) ||
+        !Contains(vaddr, count * sizeof(T))) {
+      return nullptr;
+    }
+    return reinterpret_cast<const T*>(&image[vaddr]);
+  }
+  // Copies len bytes at vaddr to out. The image ends before .bss, which
+  // reads as zero. Fails past the end of .bss.
+  bool Read(u64 vaddr, void* out, size_t len) const {
+    auto& data = segments[kData];
+    u64 end = std::max<u64>(image_size, data.addr + data.size + data.bss_size);
+    if (vaddr > end || len > end - vaddr) {
+      return false;
+    }
+    size_t mapped = 0;
+    if (vaddr < image_size) {
+      mapped = static_cast<size_t>(std::min<u64>(len, image_size - vaddr));
+      memcpy(out, &image[vaddr], mapped);
+    }
+    memset(static_cast<u8*>(out) + mapped, 0, len - mapped);
+    return true;
+  }
+  int SegmentOf(u64 vaddr) const {
+    for (int i = 0; i < kNumSegment; i++) {
+      auto& seg = segments[i];
+      if (vaddr >= seg.addr && vaddr < seg.addr + seg.size + seg.bss_size) {
+        return i;
+      }
+    }
+    return kNumSegment;
+  }
+  // Identifies the module: its build id, or the image hash without one
+  const u8* ModuleId(size_t* size) const {
+    *size = image_hash ? 32 : build_id_size;
+    return image_hash ? image_hash : build_id;
+  }
+  const char* SymbolName(const Elf64_Sym& sym) const {
+    return sym.st_name < dynstr_size ? &dynstr[sym.st_name] : "";
+  }
+
+  const u8* image;
+  size_t image_size;
+  Segment segments[kNumSegment];
+  const u8* build_id;
+  size_t build_id_size;
+  // BLAKE3 of the segments (32 bytes) if there is no build id, else nullptr
+  const u8* image_hash;
+
+  const Elf64_Dyn* dynamic;
+  size_t num_dynamic;
+  const Elf64_Sym* dynsym;
+  size_t num_dynsym;
+  const char* dynstr;
+  size_t dynstr_size;
+  const Elf64_Rela* rela;
+  size_t num_rela;
+  const Elf64_Rela* jmprel;
+  size_t num_jmprel;
+
+  u64 plt_addr;
+  u64 plt_size;
+  u64 eh_frame_hdr_addr;
+  u64 eh_frame_hdr_size;
+  // 0 if absent
+  u64 hash_addr;
+  u64 gnu_hash_addr;
+  u64 api_info_addr;
+  u64 api_info_size;
+};
+
+// Section to be added to the ELF. Sections with SHF_ALLOC describe a range of
+// the image at addr; other sections carry their contents in data.
+struct PassSection {
+  std::string name;
+  u32 type;
+  u64 flags;
+  u64 addr;
+  u64 size;
+  u64 addralign;
+  u64 entsize;
+  std::vector<u8> data;
+};
+
+// Symbol to be added to the synthesized .symtab.
+struct PassSymbol {
+  std::string name;
+  u64 value;
+  u64 size;
+  u8 type;
+  u8 bind;
+};
+
+// File written next to the output, at <output path><suffix>.
+struct PassArtifact {
+  std::string suffix;
+  std::vector<u8> data;
+};
+
+struct PassResult {
+  bool ok;
+  std::vector<PassSection> sections;
+  std::vector<PassSymbol> symbols;
+  std::vector<PassArtifact> artifacts;
+  // Sizes of zero-sized .dynsym entries, by symbol index. They are applied to
+  // the copies in the synthesized .symtab; .dynsym itself is left as is.
+  std::vector<std::pair<u32, u64>> dynsym_sizes;
+  // Pass-specific results for dependent passes
+  std::shared_ptr<const void> data;
+};
+typedef std::map<std::string, PassResult> PassResults;
+
+struct PassContext {
+  // Result of a (transitive) dependency, or nullptr if it failed.
+  const PassResult* Find(const char* name) const {
+    auto it = results->find(name);
+    if (it == results->end() || !it->second.ok) {
+      return nullptr;
+    }
+    return &it->second;
+  }
+  const ImageView& view;
+  // Threads the pass may use internally
+  unsigned jobs;
+  const PassResults* results;
+};
+
+class AnalysisPass {
+ public:
+  virtual ~AnalysisPass() = default;
+  virtual const char* Name() const = 0;
+  // Passes whose results must be available in PassContext::Find.
+  virtual std::vector<std::string> Dependencies() const { return {}; }
+  // Whether the pass runs without being named by --passes.
+  virtual bool DefaultEnabled() const { return true; }
+  virtual bool Run(const PassContext& ctx, PassResult* result) = 0;
+};
+
+struct PassRegistry {
+  static PassRegistry& Get();
+  void Register(std::unique_ptr<AnalysisPass> pass) {
+    passes.push_back(std::move(pass));
+  }
+  AnalysisPass* Find(const std::string& name) const {
+    for (auto& pass : passes) {
+      if (name == pass->Name()) {
+        return pass.get();
+      }
+    }
+    return nullptr;
+  }
+  // Loads a shared object exporting nx2elf_register_passes.
+  bool LoadPlugin(const char* path);
+  // Selects passes from a comma separated list. "all" enables every pass,
+  // "none" disables them; a leading '-' disables a single pass.
+  bool Select(const char* list);
+  bool IsEnabled(const AnalysisPass& pass) const;
+  // Runs the enabled passes (and their dependencies). Passes whose
+  // dependencies are complete run concurrently on up to |jobs| threads.
+  void Run(const ImageView& view, unsigned jobs, PassResults* results) const;
+
+  std::vector<std::unique_ptr<AnalysisPass>> passes;
+  // Per-pass choices from Select; other passes follow all/none, then
+  // DefaultEnabled.
+  std::map<std::string, bool> overrides;
+  bool all{};
+  bool none{};
+};
+
+// Entry point exported by plugins with C linkage.
+typedef void (*RegisterPassesFn)(PassRegistry* registry);
+#define NX2ELF_PLUGIN_ENTRY "nx2elf_register_passes"
+
+template <typename T>
+struct PassRegistrar {
+  PassRegistrar() { PassRegistry::Get().Register(std::make_unique<T>()); }
+};
+#define REGISTER_ANALYSIS_PASS(cls) \
+  static PassRegistrar<cls> cls##_registrar
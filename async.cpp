@@ -0,0 +1,242 @@
+#include <algorithm>
+#include <atomic>
+
+#include "analysis.h"
+#include "async.h"
+
+#ifdef _WIN32
+#include <io.h>
+#define read _read
+#define write _write
+#else
+#include <unistd.h>
+#endif
+
+namespace {
+
+const size_t read_chunk = 1 << 20;
+const size_t write_chunk = 1 << 20;
+
+// State of one AsyncLoad, shared by its tasks. The reading fields are only
+// used by the io tasks, which run one after another.
+struct LoadState : std::enable_shared_from_this<LoadState> {
+  LoadState(const AsyncContext& context,
+            int fd,
+            std::function<void(std::unique_ptr<NsoFile>)> done)
+      : context(context), fd(fd), done(std::move(done)) {}
+
+  void Read() {
+    if (filled == file.size()) {
+      file.resize(filled + read_chunk);
+    }
+    auto len = read(fd, &file[filled],
+                    static_cast<unsigned>(file.size() - filled));
+    if (len < 0) {
+      perror("read");
+      Fail();
+      return;
+    }
+    filled += len;
+    if (!len) {
+      // EOF
+      if (is_nso) {
+        fputs("NSO is truncated\n", stderr);
+        Fail();
+        return;
+      }
+      file.resize(filled);
+      auto self = shared_from_this();
+      context.cpu->Post([self] { self->LoadWhole(); });
+      return;
+    }
+    // The buffer starts out sized for the header
+    if (!probed && filled == file.size()) {
+      probed = true;
+      if (!StartNso()) {
+        return;
+      }
+    }
+    if (is_nso) {
+      PostSegments();
+      if (posted == NsoFile::kNumSegment) {
+        return;
+      }
+    }
+    auto self = shared_from_this();
+    context.io->Post([self] { self->Read(); });
+  }
+
+  // Sizes the buffer to the end of the last segment once the header is in,
+  // so segments being decompressed stay in place while the rest is read.
+  bool StartNso() {
+    auto header = reinterpret_cast<const NsoFile::NsoHeader*>(file.data());
+    if (memcmp(header->magic, NsoFile::nso_magic.data(),
+               NsoFile::nso_magic.size())) {
+      return true;
+    }
+    is_nso = true;
+    nso->header = *header;
+    u64 end = filled;
+    for (int i = 0; i < NsoFile::kNumSegment; i++) {
+      end = std::max<u64>(end, u64(nso->header.segments[i].file_offset) +
+                                   nso->header.segment_file_sizes[i]);
+      order[i] = i;
+    }
+    if (!nso->AllocateNsoImage(end)) {
+      Fail();
+      return false;
+    }
+    std::sort(order, order + NsoFile::kNumSegment, [this](int a, int b) {
+      return nso->header.segments[a].file_offset <
+             nso->header.segments[b].file_offset;
+    });
+    file.resize(end);
+    return true;
+  }
+
+  // Hands every segment which has been read completely to the cpu executor
+  void PostSegments() {
+    auto& header = nso->header;
+    while (posted < NsoFile::kNumSegment) {
+      int i = order[posted];
+      if (u64(header.segments[i].file_offset) + header.segment_file_sizes[i] >
+          filled) {
+        break;
+      }
+      posted++;
+      auto self = shared_from_this();
+      context.cpu->Post([self, i] {
+        auto offset = self->nso->header.segments[i].file_offset;
+        if (!self->nso->LoadNsoSegment(i, self->file.data() + offset)) {
+          self->failed = true;
+        }
+        self->SegmentDone(1);
+      });
+    }
+  }
+
+  void SegmentDone(int count) {
+    if ((remaining -= count) == 0) {
+      FinishNso();
+    }
+  }
+
+  void FinishNso() {
+    std::vector<u8>().swap(file);
+    nso->file_type = NsoFile::kNso;
+    if (failed || !nso->ParseModule({}) || !nso->FinishLoad(1)) {
+      done(nullptr);
+      return;
+    }
+    done(std::move(nso));
+  }
+
+  void LoadWhole() {
+    if (!nso->Load(std::move(file))) {
+      done(nullptr);
+      return;
+    }
+    done(std::move(nso));
+  }
+
+  // Segments already posted finish first
+  void Fail() {
+    if (!is_nso) {
+      auto self = shared_from_this();
+      context.cpu->Post([self] { self->done(nullptr); });
+      return;
+    }
+    failed = true;
+    int unposted = NsoFile::kNumSegment - posted;
+    posted = NsoFile::kNumSegment;
+    if (unposted) {
+      auto self = shared_from_this();
+      context.cpu->Post([self, unposted] { self->SegmentDone(unposted); });
+    }
+  }
+
+  AsyncContext context;
+  int fd;
+  std::function<void(std::unique_ptr<NsoFile>)> done;
+  std::unique_ptr<NsoFile> nso = std::make_unique<NsoFile>();
+  std::vector<u8> file = std::vector<u8>(sizeof(NsoFile::NsoHeader));
+  size_t filled{};
+  // Whether the header has been checked for an NSO
+  bool probed{};
+  bool is_nso{};
+  // Segments in file order; the first |posted| have been handed out
+  int order[NsoFile::kNumSegment]{};
+  int posted{};
+  std::atomic<int> remaining{NsoFile::kNumSegment};
+  std::atomic<bool> failed{};
+};
+
+struct WriteState : std::enable_shared_from_this<WriteState> {
+  void Build() {
+    PassResults passes;
+    if (!PassRegistry::Get().passes.empty()) {
+      PassRegistry::Get().Run(nso->GetView(), 1, &passes);
+    }
+    nso->BuildElf(&elf, &passes);
+    auto self = shared_from_this();
+    context.io->Post([self] { self->Write(); });
+  }
+
+  void Write() {
+    size_t len = std::min(elf.size() - written, write_chunk);
+    if (!sink(&elf[written], len)) {
+      done(false);
+      return;
+    }
+    written += len;
+    if (written == elf.size()) {
+      done(true);
+      return;
+    }
+    auto self = shared_from_this();
+    context.io->Post([self] { self->Write(); });
+  }
+
+  AsyncContext context;
+  std::shared_ptr<NsoFile> nso;
+  AsyncSink sink;
+  std::function<void(bool)> done;
+  std::vector<u8> elf;
+  size_t written{};
+};
+
+}  // namespace
+
+AsyncSink FdSink(int fd) {
+  return [fd](const u8* data, size_t size) {
+    for (size_t done = 0; done < size;) {
+      auto len = write(fd, &data[done],
+                       static_cast<unsigned>(std::min<size_t>(size - done,
+                                                              1 << 30)));
+      if (len <= 0) {
+        return false;
+      }
+      done += len;
+    }
+    return true;
+  };
+}
+
+void AsyncLoad(const AsyncContext& context,
+               int fd,
+               std::function<void(std::unique_ptr<NsoFile>)> done) {
+  auto state = std::make_shared<LoadState>(context, fd, std::move(done));
+  context.io->Post([state] { state->Read(); });
+}
+
+void AsyncWriteElf(const AsyncContext& context,
+                   std::shared_ptr<NsoFile> nso,
+                   AsyncSink sink,
+                   std::function<void(bool)> done) {
+  auto state = std::make_shared<WriteState>();
+  state->context = context;
+  state->nso = std::move(nso);
+  state->sink = std::move(sink);
+  state->done = std::move(done);
+  context.cpu->Post([state] { state->Build(); });
+}
@@ -0,0 +1,189 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "nso.h"
+#include "types.h"
+
+// Asynchronous loading and conversion for event driven hosts. Every call
+// returns at once; the work runs as short tasks on the host's executors and
+// the result is handed to a callback. Built into libnx2elf.a, not the
+// shared library or the command line tool.
+
+// Runs posted tasks. Tasks must not block on each other.
+class Executor {
+ public:
+  virtual ~Executor() = default;
+  virtual void Post(std::function<void()> task) = 0;
+};
+
+// Executor with a fixed set of threads. The destructor runs the tasks still
+// queued, including ones they post, and joins the threads.
+class ThreadPool : public Executor {
+ public:
+  explicit ThreadPool(unsigned threads) {
+    for (unsigned i = 0; i < std::max(1u, threads); i++) {
+      threads_.emplace_back([this] { Work(); });
+    }
+  }
+  ~ThreadPool() override {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      closing_ = true;
+    }
+    cv_.notify_all();
+    for (auto& thread : threads_) {
+      thread.join();
+    }
+  }
+  void Post(std::function<void()> task) override {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      tasks_.push_back(std::move(task));
+      pending_++;
+    }
+    cv_.notify_one();
+  }
+
+ private:
+  void Work() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+      cv_.wait(lock,
+               [this] { return !tasks_.empty() || (closing_ && !pending_); });
+      if (tasks_.empty()) {
+        return;
+      }
+      auto task = std::move(tasks_.front());
+      tasks_.pop_front();
+      lock.unlock();
+      task();
+      lock.lock();
+      // Running tasks may still post more
+      if (!--pending_ && closing_) {
+        cv_.notify_all();
+      }
+    }
+  }
+
+  std::vector<std::thread> threads_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<std::function<void()>> tasks_;
+  // Queued and running tasks
+  size_t pending_{};
+  bool closing_{};
+};
+
+struct AsyncContext {
+  // Blocking reads and writes
+  Executor* io;
+  // Decompression, analysis passes and building the ELF
+  Executor* cpu;
+};
+
+// Receives the output in order, on an io thread. Returns false on failure.
+typedef std::function<bool(const u8* data, size_t size)> AsyncSink;
+
+// Writes to |fd|, which is not closed.
+AsyncSink FdSink(int fd);
+
+// Reads a module from |fd|, from its current position until EOF; |fd| may
+// be a pipe or socket. Each read is its own io task. NSO segments are
+// decompressed on the cpu executor as soon as they have been read, while
+// the rest is still being read. |done| runs on a cpu thread with the module,
+// or nullptr on failure.
+void AsyncLoad(const AsyncContext& context,
+               int fd,
+               std::function<void(std::unique_ptr<NsoFile>)> done);
+
+// Runs the enabled analysis passes and builds the ELF on the cpu executor,
+// then hands it to |sink| in chunks, each an io task. |done| runs on an io
+// thread.
+void AsyncWriteElf(const AsyncContext& context,
+                   std::shared_ptr<NsoFile> nso,
+                   AsyncSink sink,
+                   std::function<void(bool)> done);
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+
+// Awaitable forms for C++20 callers:
+//   auto nso = co_await nx::load(context, fd);
+//   bool ok = nso && co_await nso.write_elf(sink);
+// The coroutine resumes on the executor thread that completed the operation.
+namespace nx {
+
+struct WriteElfAwaiter {
+  bool await_ready() const { return false; }
+  void await_suspend(std::coroutine_handle<> handle) {
+    AsyncWriteElf(context, std::move(nso), std::move(sink),
+                  [this, handle](bool ok) {
+                    result = ok;
+                    handle.resume();
+                  });
+  }
+  bool await_resume() const { return result; }
+
+  AsyncContext context;
+  std::shared_ptr<NsoFile> nso;
+  AsyncSink sink;
+  bool result{};
+};
+
+inline WriteElfAwaiter write_elf(const AsyncContext& context,
+                                 std::shared_ptr<NsoFile> nso,
+                                 AsyncSink sink) {
+  return {context, std::move(nso), std::move(sink)};
+}
+
+// A loaded module with the context it was loaded on; empty on failure.
+class Module {
+ public:
+  Module() = default;
+  Module(const AsyncContext& context, std::unique_ptr<NsoFile> nso)
+      : context_(context), nso_(std::move(nso)) {}
+
+  explicit operator bool() const { return nso_ != nullptr; }
+  NsoFile& operator*() const { return *nso_; }
+  NsoFile* operator->() const { return nso_.get(); }
+  const std::shared_ptr<NsoFile>& get() const { return nso_; }
+
+  // The module is shared with the write until it completes
+  WriteElfAwaiter write_elf(AsyncSink sink) const {
+    return nx::write_elf(context_, nso_, std::move(sink));
+  }
+
+ private:
+  AsyncContext context_{};
+  std::shared_ptr<NsoFile> nso_;
+};
+
+struct LoadAwaiter {
+  bool await_ready() const { return false; }
+  void await_suspend(std::coroutine_handle<> handle) {
+    AsyncLoad(context, fd, [this, handle](std::unique_ptr<NsoFile> nso) {
+      result = std::move(nso);
+      handle.resume();
+    });
+  }
+  Module await_resume() { return {context, std::move(result)}; }
+
+  AsyncContext context;
+  int fd;
+  std::unique_ptr<NsoFile> result;
+};
+
+inline LoadAwaiter load(const AsyncContext& context, int fd) {
+  return {context, fd, nullptr};
+}
+
+}  // namespace nx
+#endif
@@ -0,0 +1,267 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <vector>
+
+#include "parallel.h"
+#include "types.h"
+
+// BLAKE3 (https://github.com/BLAKE3-team/BLAKE3) in its default hashing mode
+// with 32 byte output, following the portable reference implementation.
+namespace BLAKE3 {
+
+typedef std::array<u8, 32> Digest;
+
+constexpr size_t kBlockLen = 64;
+constexpr size_t kChunkLen = 1024;
+enum : u32 {
+  kChunkStart = 1 << 0,
+  kChunkEnd = 1 << 1,
+  kParent = 1 << 2,
+  kRoot = 1 << 3,
+};
+constexpr u32 kIv[8] = {0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+                        0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19};
+constexpr u8 kPermutation[16] = {2, 6,  3,  10, 7, 0,  4,  13,
+                                 1, 11, 12, 5,  9, 14, 15, 8};
+
+inline u32 Rotr(u32 x, int r) { return (x >> r) | (x << (32 - r)); }
+inline void G(u32* s, int a, int b, int c, int d, u32 mx, u32 my) {
+  s[a] = s[a] + s[b] + mx;
+  s[d] = Rotr(s[d] ^ s[a], 16);
+  s[c] = s[c] + s[d];
+  s[b] = Rotr(s[b] ^ s[c], 12);
+  s[a] = s[a] + s[b] + my;
+  s[d] = Rotr(s[d] ^ s[a], 8);
+  s[c] = s[c] + s[d];
+  s[b] = Rotr(s[b] ^ s[c], 7);
+}
+inline void Compress(const u32 cv[8],
+                     const u32 block[16],
+                     u64 counter,
+                     u32 block_len,
+                     u32 flags,
+                     u32 out[16]) {
+  u32 s[16] = {cv[0],  cv[1],  cv[2],  cv[3],
+               cv[4],  cv[5],  cv[6],  cv[7],
+               kIv[0], kIv[1], kIv[2], kIv[3],
+               static_cast<u32>(counter), static_cast<u32>(counter >> 32),
+               block_len, flags};
+  u32 m[16];
+  memcpy(m, block, sizeof(m));
+  for (int round = 0; round < 7; round++) {
+    G(s, 0, 4, 8, 12, m[0], m[1]);
+    G(s, 1, 5, 9, 13, m[2], m[3]);
+    G(s, 2, 6, 10, 14, m[4], m[5]);
+    G(s, 3, 7, 11, 15, m[6], m[7]);
+    G(s, 0, 5, 10, 15, m[8], m[9]);
+    G(s, 1, 6, 11, 12, m[10], m[11]);
+    G(s, 2, 7, 8, 13, m[12], m[13]);
+    G(s, 3, 4, 9, 14, m[14], m[15]);
+    u32 permuted[16];
+    for (int i = 0; i < 16; i++) {
+      permuted[i] = m[kPermutation[i]];
+    }
+    memcpy(m, permuted, sizeof(m));
+  }
+  for (int i = 0; i < 8; i++) {
+    out[i] = s[i] ^ s[i + 8];
+    out[i + 8] = s[i + 8] ^ cv[i];
+  }
+}
+
+// Input of a compression whose result is either a chaining value or, with
+// kRoot, the hash itself.
+struct Output {
+  void ChainingValue(u32 cv[8]) const {
+    u32 out[16];
+    Compress(input_cv, block, counter, block_len, flags, out);
+    memcpy(cv, out, 8 * sizeof(u32));
+  }
+  Digest Root() const {
+    u32 out[16];
+    Compress(input_cv, block, 0, block_len, flags | kRoot, out);
+    Digest digest;
+    memcpy(digest.data(), out, digest.size());
+    return digest;
+  }
+  static Output Parent(const u32 left[8], const u32 right[8]) {
+    Output output{};
+    memcpy(output.input_cv, kIv, sizeof(kIv));
+    memcpy(output.block, left, 8 * sizeof(u32));
+    memcpy(output.block + 8, right, 8 * sizeof(u32));
+    output.block_len = kBlockLen;
+    output.flags = kParent;
+    return output;
+  }
+
+  u32 input_cv[8];
+  u32 block[16];
+  u64 counter;
+  u32 block_len;
+  u32 flags;
+};
+
+struct ChunkState {
+  explicit ChunkState(u64 chunk_counter) : chunk_counter(chunk_counter) {
+    memcpy(cv, kIv, sizeof(kIv));
+  }
+  size_t Len() const { return kBlockLen * blocks_compressed + block_len; }
+  u32 StartFlag() const { return blocks_compressed ? 0u : kChunkStart; }
+  void Update(const u8* input, size_t len) {
+    while (len) {
+      // The last block is kept back for Output, which sets kChunkEnd
+      if (block_len == kBlockLen) {
+        u32 words[16], out[16];
+        memcpy(words, block, sizeof(words));
+        Compress(cv, words, chunk_counter, kBlockLen, StartFlag(), out);
+        memcpy(cv, out, sizeof(cv));
+        blocks_compressed++;
+        block_len = 0;
+        memset(block, 0, sizeof(block));
+      }
+      size_t take = std::min(kBlockLen - block_len, len);
+      memcpy(&block[block_len], input, take);
+      block_len += take;
+      input += take;
+      len -= take;
+    }
+  }
+  Output GetOutput() const {
+    Output output{};
+    memcpy(output.input_cv, cv, sizeof(cv));
+    memcpy(output.block, block, sizeof(block));
+    output.counter = chunk_counter;
+    output.block_len = static_cast<u32>(block_len);
+    output.flags = StartFlag() | kChunkEnd;
+    return output;
+  }
+
+  u32 cv[8];
+  u64 chunk_counter;
+  u8 block[kBlockLen]{};
+  size_t block_len{};
+  size_t blocks_compressed{};
+};
+
+// Incremental hasher over the chunks starting at |chunk_counter|. A hasher
+// started at a multiple of 2^n chunks and fed at most 2^n chunks computes
+// the chaining value of that subtree, so subtrees can be hashed in parallel.
+class Hasher {
+ public:
+  explicit Hasher(u64 chunk_counter = 0) : chunk_(chunk_counter) {}
+
+  void Update(const void* data, size_t len) {
+    auto input = static_cast<const u8*>(data);
+    while (len) {
+      if (chunk_.Len() == kChunkLen) {
+        u32 cv[8];
+        chunk_.GetOutput().ChainingValue(cv);
+        u64 total_chunks = chunk_.chunk_counter + 1;
+        PushChainingValue(cv, total_chunks);
+        chunk_ = ChunkState(total_chunks);
+      }
+      size_t take = std::min(kChunkLen - chunk_.Len(), len);
+      chunk_.Update(input, take);
+      input += take;
+      len -= take;
+    }
+  }
+  Digest Finalize() const { return GetOutput().Root(); }
+  void SubtreeChainingValue(u32 cv[8]) const { GetOutput().ChainingValue(cv); }
+
+ private:
+  // Merges the completed subtrees below the new chunk, as counted by the
+  // trailing zero bits of the total number of chunks
+  void PushChainingValue(const u32 cv[8], u64 total_chunks) {
+    u32 merged[8];
+    memcpy(merged, cv, sizeof(merged));
+    for (; !(total_chunks & 1); total_chunks >>= 1) {
+      Output::Parent(stack_.back().data(), merged).ChainingValue(merged);
+      stack_.pop_back();
+    }
+    stack_.emplace_back();
+    memcpy(stack_.back().data(), merged, sizeof(merged));
+  }
+  Output GetOutput() const {
+    Output output = chunk_.GetOutput();
+    for (size_t i = stack_.size(); i--;) {
+      u32 cv[8];
+      output.ChainingValue(cv);
+      output = Output::Parent(stack_[i].data(), cv);
+    }
+    return output;
+  }
+
+  ChunkState chunk_;
+  std::vector<std::array<u32, 8>> stack_;
+};
+
+inline Digest Hash(const void* data, size_t len) {
+  Hasher hasher;
+  hasher.Update(data, len);
+  return hasher.Finalize();
+}
+
+struct Range {
+  const u8* data;
+  u64 size;
+};
+
+// Hash of the concatenated |ranges|. Subtrees of subtree_size bytes (a power
+// of two multiple of kChunkLen) are hashed on up to |jobs| threads and then
+// merged like the chunks of a sequential hasher.
+inline Digest HashRanges(const std::vector<Range>& ranges,
+                         unsigned jobs,
+                         size_t subtree_size = 1 << 20) {
+  u64 total = 0;
+  for (auto& range : ranges) {
+    total += range.size;
+  }
+  // Feeds [begin, end) of the concatenation to |hasher|
+  auto feed = [&ranges](Hasher* hasher, u64 begin, u64 end) {
+    u64 offset = 0;
+    for (auto& range : ranges) {
+      u64 first = std::max(begin, offset);
+      u64 last = std::min(end, offset + range.size);
+      if (first < last) {
+        hasher->Update(range.data + (first - offset), last - first);
+      }
+      offset += range.size;
+    }
+  };
+  if (total <= subtree_size) {
+    Hasher hasher;
+    feed(&hasher, 0, total);
+    return hasher.Finalize();
+  }
+
+  size_t count = (total + subtree_size - 1) / subtree_size;
+  std::vector<std::array<u32, 8>> cvs(count);
+  ParallelFor(count, jobs, [&](size_t i) {
+    Hasher hasher(i * (subtree_size / kChunkLen));
+    feed(&hasher, i * subtree_size,
+         std::min<u64>(total, (i + 1) * u64(subtree_size)));
+    hasher.SubtreeChainingValue(cvs[i].data());
+  });
+
+  std::vector<std::array<u32, 8>> stack;
+  for (size_t i = 0; i + 1 < count; i++) {
+    auto merged = cvs[i];
+    for (u64 n = i + 1; !(n & 1); n >>= 1) {
+      Output::Parent(stack.back().data(), merged.data())
+          .ChainingValue(merged.data());
+      stack.pop_back();
+    }
+    stack.push_back(merged);
+  }
+  auto right = cvs.back();
+  for (size_t i = stack.size(); --i;) {
+    Output::Parent(stack[i].data(), right.data()).ChainingValue(right.data());
+  }
+  return Output::Parent(stack[0].data(), right.data()).Root();
+}
+
+}  // namespace BLAKE3
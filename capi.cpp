@@ -0,0 +1,283 @@
+#include "nx2elf.h"
+
+#include "nso.h"
+#include "parallel.h"
+#include "pointer_index.h"
+
+#ifdef _WIN32
+#include <io.h>
+#define read _read
+#define write _write
+#else
+#include <unistd.h>
+#endif
+
+static_assert(sizeof(nx2elf_pointer) == sizeof(PointerEdge) &&
+                  offsetof(nx2elf_pointer, target) ==
+                      offsetof(PointerEdge, target),
+              "nx2elf_pointer must match the index layout");
+
+struct nx2elf_file {
+  NsoFile nso;
+  ImageView view;
+  PassResults passes;
+  // Built on first query
+  std::unique_ptr<PointerIndex> pointers;
+  // Outputs are built on first use so size queries don't redo the work
+  std::vector<u8> elf;
+  std::vector<u8> uncompressed;
+};
+
+static nx2elf_file* Open(std::vector<u8> buffer) {
+  auto file = std::make_unique<nx2elf_file>();
+  if (buffer.empty() || !file->nso.Load(std::move(buffer), DefaultJobs())) {
+    return nullptr;
+  }
+  file->view = file->nso.GetView();
+  return file.release();
+}
+
+static int CopyOut(const std::vector<u8>& data, void* buf, size_t* size) {
+  if (!size) {
+    return NX2ELF_ERR_INVALID;
+  }
+  if (!buf || *size < data.size()) {
+    *size = data.size();
+    return NX2ELF_ERR_BUFFER_TOO_SMALL;
+  }
+  memcpy(buf, data.data(), data.size());
+  *size = data.size();
+  return NX2ELF_OK;
+}
+
+static int WriteFd(const std::vector<u8>& data, int fd) {
+  size_t done = 0;
+  while (done < data.size()) {
+    auto len = std::min<size_t>(data.size() - done, 1 << 30);
+    auto written = write(fd, &data[done], static_cast<unsigned>(len));
+    if (written <= 0) {
+      return NX2ELF_ERR_IO;
+    }
+    done += written;
+  }
+  return NX2ELF_OK;
+}
+
+static const std::vector<u8>& GetElf(nx2elf_file* file) {
+  if (file->elf.empty()) {
+    file->nso.BuildElf(&file->elf, &file->passes);
+  }
+  return file->elf;
+}
+
+static const std::vector<u8>& GetUncompressed(nx2elf_file* file) {
+  if (file->uncompressed.empty()) {
+    file->nso.BuildUncompressedNso(&file->uncompressed);
+  }
+  return file->uncompressed;
+}
+
+extern "C" {
+
+nx2elf_file* nx2elf_open_memory(const void* data, size_t size) {
+  if (!data) {
+    return nullptr;
+  }
+  auto p = static_cast<const u8*>(data);
+  return Open(std::vector<u8>(p, p + size));
+}
+
+nx2elf_file* nx2elf_open_fd(int fd) {
+  std::vector<u8> buffer;
+  const size_t chunk = 1 << 20;
+  for (;;) {
+    size_t used = buffer.size();
+    buffer.resize(used + chunk);
+    auto len = read(fd, &buffer[used], chunk);
+    if (len < 0) {
+      return nullptr;
+    }
+    buffer.resize(used + len);
+    if (len == 0) {
+      break;
+    }
+  }
+  return Open(std::move(buffer));
+}
+
+nx2elf_file* nx2elf_open_path(const char* path) {
+  if (!path) {
+    return nullptr;
+  }
+  return Open(File::Read(path));
+}
+
+void nx2elf_close(nx2elf_file* file) {
+  delete file;
+}
+
+int nx2elf_get_type(const nx2elf_file* file) {
+  return file ? static_cast<int>(file->nso.file_type) : NX2ELF_TYPE_UNKNOWN;
+}
+
+int nx2elf_get_header(const nx2elf_file* file, nx2elf_view* header) {
+  if (!file || !header) {
+    return NX2ELF_ERR_INVALID;
+  }
+  *header = {&file->nso.header, sizeof(file->nso.header)};
+  return NX2ELF_OK;
+}
+
+int nx2elf_get_build_id(const nx2elf_file* file, nx2elf_view* build_id) {
+  if (!file || !build_id) {
+    return NX2ELF_ERR_INVALID;
+  }
+  *build_id = {file->view.build_id, file->view.build_id_size};
+  return NX2ELF_OK;
+}
+
+int nx2elf_get_module_id(const nx2elf_file* file, nx2elf_view* id) {
+  if (!file || !id) {
+    return NX2ELF_ERR_INVALID;
+  }
+  id->data = file->view.ModuleId(&id->size);
+  return NX2ELF_OK;
+}
+
+nx2elf_view nx2elf_get_image(const nx2elf_file* file) {
+  if (!file) {
+    return {};
+  }
+  return {file->view.image, file->view.image_size};
+}
+
+int nx2elf_read(const nx2elf_file* file,
+                uint64_t vaddr,
+                void* out,
+                size_t size) {
+  if (!file || (!out && size) || !file->view.Read(vaddr, out, size)) {
+    return NX2ELF_ERR_INVALID;
+  }
+  return NX2ELF_OK;
+}
+
+int nx2elf_get_segment(const nx2elf_file* file,
+                       int index,
+                       nx2elf_segment* segment) {
+  if (!file || !segment || index < 0 || index >= NX2ELF_NUM_SEGMENTS) {
+    return NX2ELF_ERR_INVALID;
+  }
+  auto& seg = file->view.segments[index];
+  if (!file->view.Contains(seg.addr, seg.size)) {
+    return NX2ELF_ERR_INVALID;
+  }
+  *segment = {seg.addr, seg.size, seg.bss_size, &file->view.image[seg.addr]};
+  return NX2ELF_OK;
+}
+
+int nx2elf_get_dynsym(const nx2elf_file* file, nx2elf_table* symbols) {
+  if (!file || !symbols) {
+    return NX2ELF_ERR_INVALID;
+  }
+  *symbols = {file->view.dynsym, file->view.num_dynsym, sizeof(Elf64_Sym)};
+  return file->view.dynsym ? NX2ELF_OK : NX2ELF_ERR_NOT_FOUND;
+}
+
+int nx2elf_get_dynstr(const nx2elf_file* file, nx2elf_view* strings) {
+  if (!file || !strings) {
+    return NX2ELF_ERR_INVALID;
+  }
+  *strings = {file->view.dynstr, file->view.dynstr_size};
+  return file->view.dynstr ? NX2ELF_OK : NX2ELF_ERR_NOT_FOUND;
+}
+
+int nx2elf_get_rela(const nx2elf_file* file, nx2elf_table* relocations) {
+  if (!file || !relocations) {
+    return NX2ELF_ERR_INVALID;
+  }
+  *relocations = {file->view.rela, file->view.num_rela, sizeof(Elf64_Rela)};
+  return file->view.rela ? NX2ELF_OK : NX2ELF_ERR_NOT_FOUND;
+}
+
+int nx2elf_get_jmprel(const nx2elf_file* file, nx2elf_table* relocations) {
+  if (!file || !relocations) {
+    return NX2ELF_ERR_INVALID;
+  }
+  *relocations = {file->view.jmprel, file->view.num_jmprel,
+                  sizeof(Elf64_Rela)};
+  return file->view.jmprel ? NX2ELF_OK : NX2ELF_ERR_NOT_FOUND;
+}
+
+static int GetPointers(nx2elf_file* file,
+                       bool to,
+                       uint64_t start,
+                       uint64_t end,
+                       nx2elf_table* pointers) {
+  if (!file || !pointers || end < start) {
+    return NX2ELF_ERR_INVALID;
+  }
+  if (!file->pointers) {
+    file->pointers = std::make_unique<PointerIndex>();
+    file->pointers->Build(file->view, DefaultJobs());
+  }
+  auto view = file->pointers->View();
+  auto range = to ? view.To(start, end) : view.From(start, end);
+  *pointers = {range.first, static_cast<size_t>(range.second - range.first),
+               sizeof(PointerEdge)};
+  return NX2ELF_OK;
+}
+
+int nx2elf_get_pointers_to(nx2elf_file* file,
+                           uint64_t start,
+                           uint64_t end,
+                           nx2elf_table* pointers) {
+  return GetPointers(file, true, start, end, pointers);
+}
+
+int nx2elf_get_pointers_from(nx2elf_file* file,
+                             uint64_t start,
+                             uint64_t end,
+                             nx2elf_table* pointers) {
+  return GetPointers(file, false, start, end, pointers);
+}
+
+int nx2elf_run_passes(nx2elf_file* file, unsigned jobs) {
+  if (!file) {
+    return NX2ELF_ERR_INVALID;
+  }
+  file->passes.clear();
+  file->elf.clear();
+  PassRegistry::Get().Run(file->view, jobs ? jobs : DefaultJobs(),
+                          &file->passes);
+  return NX2ELF_OK;
+}
+
+int nx2elf_write_elf(nx2elf_file* file, void* buf, size_t* size) {
+  if (!file) {
+    return NX2ELF_ERR_INVALID;
+  }
+  return CopyOut(GetElf(file), buf, size);
+}
+
+int nx2elf_write_elf_fd(nx2elf_file* file, int fd) {
+  if (!file) {
+    return NX2ELF_ERR_INVALID;
+  }
+  return WriteFd(GetElf(file), fd);
+}
+
+int nx2elf_write_uncompressed(nx2elf_file* file, void* buf, size_t* size) {
+  if (!file) {
+    return NX2ELF_ERR_INVALID;
+  }
+  return CopyOut(GetUncompressed(file), buf, size);
+}
+
+int nx2elf_write_uncompressed_fd(nx2elf_file* file, int fd) {
+  if (!file) {
+    return NX2ELF_ERR_INVALID;
+  }
+  return WriteFd(GetUncompressed(file), fd);
+}
+
+}  // extern "C"
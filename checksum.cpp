@@ -0,0 +1,218 @@
+#include <string>
+#include <vector>
+
+#include "analysis.h"
+#include "checksum.h"
+#include "elf.h"
+#include "parallel.h"
+#include "xxhash64.h"
+
+std::vector<u64> TreeHashes(const std::vector<ChecksumRange>& ranges,
+                            u32 chunk_size,
+                            unsigned jobs) {
+  struct Chunk {
+    const u8* data;
+    u64 size;
+  };
+  std::vector<Chunk> chunks;
+  std::vector<size_t> first_chunk;
+  for (auto& range : ranges) {
+    first_chunk.push_back(chunks.size());
+    for (u64 offset = 0; offset < range.size; offset += chunk_size) {
+      chunks.push_back({range.data + offset,
+                        std::min<u64>(chunk_size, range.size - offset)});
+    }
+  }
+  first_chunk.push_back(chunks.size());
+  std::vector<u64> chunk_hashes(chunks.size());
+  ParallelFor(chunks.size(), jobs, [&](size_t i) {
+    chunk_hashes[i] = XXH64::Hash(chunks[i].data, chunks[i].size);
+  });
+  std::vector<u64> hashes;
+  for (size_t i = 0; i < ranges.size(); i++) {
+    hashes.push_back(XXH64::Hash(&chunk_hashes[first_chunk[i]],
+                                 (first_chunk[i + 1] - first_chunk[i]) *
+                                     sizeof(u64)));
+  }
+  return hashes;
+}
+
+bool VerifyElfChecksums(const u8* elf,
+                        size_t size,
+                        unsigned jobs,
+                        std::string* error) {
+  auto fits = [size](u64 offset, u64 len) {
+    return offset <= size && len <= size - offset;
+  };
+  Elf64_Ehdr ehdr;
+  if (size < sizeof(ehdr)) {
+    *error = "truncated header";
+    return false;
+  }
+  memcpy(&ehdr, elf, sizeof(ehdr));
+  if (!ehdr.e_ident.is_valid() || !ehdr.e_ident.is_64() ||
+      ehdr.e_phentsize != sizeof(Elf64_Phdr) ||
+      ehdr.e_shentsize != sizeof(Elf64_Shdr) ||
+      !fits(ehdr.e_phoff, u64(ehdr.e_phnum) * sizeof(Elf64_Phdr)) ||
+      !fits(ehdr.e_shoff, u64(ehdr.e_shnum) * sizeof(Elf64_Shdr))) {
+    *error = "not a 64-bit ELF or truncated headers";
+    return false;
+  }
+
+  // Find the note among the SHT_NOTE sections by its owner
+  std::vector<SegmentChecksum> stored;
+  u32 chunk_size = 0;
+  bool found = false;
+  for (u16 i = 0; i < ehdr.e_shnum && !found; i++) {
+    Elf64_Shdr shdr;
+    memcpy(&shdr, &elf[ehdr.e_shoff + i * sizeof(shdr)], sizeof(shdr));
+    Elf64_Nhdr nhdr;
+    if (shdr.sh_type != SHT_NOTE || shdr.sh_size < sizeof(nhdr)) {
+      continue;
+    }
+    if (!fits(shdr.sh_offset, shdr.sh_size)) {
+      *error = "truncated checksum note";
+      return false;
+    }
+    const u8* note = &elf[shdr.sh_offset];
+    memcpy(&nhdr, note, sizeof(nhdr));
+    u64 desc_offset = sizeof(nhdr) + ALIGN_UP(u64(nhdr.n_namesz), 4);
+    if (nhdr.n_type != NT_NX2ELF_CHECKSUMS ||
+        nhdr.n_namesz != sizeof(checksum_note_owner) ||
+        desc_offset > shdr.sh_size ||
+        memcmp(&note[sizeof(nhdr)], checksum_note_owner,
+               sizeof(checksum_note_owner))) {
+      continue;
+    }
+    ChecksumNoteHeader header;
+    u64 desc_size = std::min<u64>(nhdr.n_descsz, shdr.sh_size - desc_offset);
+    const u8* desc = &note[desc_offset];
+    if (desc_size < sizeof(header)) {
+      *error = "bad checksum note";
+      return false;
+    }
+    memcpy(&header, desc, sizeof(header));
+    if (header.version != 1 || !header.chunk_size ||
+        header.count > (desc_size - sizeof(header)) / sizeof(SegmentChecksum)) {
+      *error = "bad checksum note";
+      return false;
+    }
+    stored.resize(header.count);
+    if (header.count) {
+      memcpy(stored.data(), &desc[sizeof(header)],
+             header.count * sizeof(SegmentChecksum));
+    }
+    chunk_size = header.chunk_size;
+    found = true;
+  }
+  if (!found) {
+    *error = "no checksum note";
+    return false;
+  }
+
+  std::vector<ChecksumRange> ranges;
+  for (auto& checksum : stored) {
+    const Elf64_Phdr* load = nullptr;
+    for (u16 i = 0; i < ehdr.e_phnum; i++) {
+      auto phdr = reinterpret_cast<const Elf64_Phdr*>(
+          &elf[ehdr.e_phoff + i * sizeof(Elf64_Phdr)]);
+      if (phdr->p_type == PT_LOAD && phdr->p_vaddr == checksum.vaddr) {
+        load = phdr;
+        break;
+      }
+    }
+    if (!load || load->p_filesz != checksum.size ||
+        !fits(load->p_offset, load->p_filesz)) {
+      char buf[96];
+      snprintf(buf, sizeof(buf), "segment at %" PRIx64 " missing or truncated",
+               checksum.vaddr);
+      *error = buf;
+      return false;
+    }
+    ranges.push_back({&elf[load->p_offset], load->p_filesz});
+  }
+  auto hashes = TreeHashes(ranges, chunk_size, jobs);
+  for (size_t i = 0; i < stored.size(); i++) {
+    if (hashes[i] != stored[i].hash) {
+      char buf[96];
+      snprintf(buf, sizeof(buf), "segment at %" PRIx64 " checksum mismatch",
+               stored[i].vaddr);
+      *error = buf;
+      return false;
+    }
+  }
+  return true;
+}
+
+namespace {
+
+std::vector<u8> BuildNote(u32 type, const std::vector<u8>& desc) {
+  Elf64_Nhdr nhdr{sizeof(checksum_note_owner), static_cast<u32>(desc.size()),
+                  type};
+  u64 name_size = ALIGN_UP(sizeof(checksum_note_owner), 4);
+  std::vector<u8> note(sizeof(nhdr) + name_size + desc.size());
+  memcpy(note.data(), &nhdr, sizeof(nhdr));
+  memcpy(&note[sizeof(nhdr)], checksum_note_owner,
+         sizeof(checksum_note_owner));
+  std::copy(desc.begin(), desc.end(), &note[sizeof(nhdr) + name_size]);
+  return note;
+}
+
+// Stores the hashes of the segments, which BuildElf copies verbatim into the
+// PT_LOADs, in a note for --verify-output. Opt-in via --passes.
+class ChecksumPass : public AnalysisPass {
+ public:
+  const char* Name() const override { return "checksums"; }
+  bool DefaultEnabled() const override { return false; }
+  bool Run(const PassContext& ctx, PassResult* result) override {
+    auto& view = ctx.view;
+    const u32 chunk_size = 1 << 20;
+    std::vector<ChecksumRange> ranges;
+    for (auto& seg : view.segments) {
+      if (!view.Contains(seg.addr, seg.size)) {
+        return false;
+      }
+      ranges.push_back({&view.image[seg.addr], seg.size});
+    }
+    auto hashes = TreeHashes(ranges, chunk_size, ctx.jobs);
+
+    ChecksumNoteHeader header{1, chunk_size,
+                              static_cast<u32>(ranges.size()), 0};
+    std::vector<u8> desc(sizeof(header) +
+                         ranges.size() * sizeof(SegmentChecksum));
+    u8* p = desc.data();
+    memcpy(p, &header, sizeof(header));
+    p += sizeof(header);
+    for (size_t i = 0; i < ranges.size(); i++) {
+      SegmentChecksum checksum{view.segments[i].addr, view.segments[i].size,
+                               hashes[i]};
+      memcpy(p, &checksum, sizeof(checksum));
+      p += sizeof(checksum);
+    }
+    result->sections.push_back({checksum_section_name, SHT_NOTE, 0, 0, 0, 4, 0,
+                                BuildNote(NT_NX2ELF_CHECKSUMS, desc)});
+    return true;
+  }
+};
+
+REGISTER_ANALYSIS_PASS(ChecksumPass);
+
+// Records the image hash computed at load time, so the ELF carries the same
+// identity as the module it came from.
+class ImageHashPass : public AnalysisPass {
+ public:
+  const char* Name() const override { return "image_hash"; }
+  bool Run(const PassContext& ctx, PassResult* result) override {
+    auto hash = ctx.view.image_hash;
+    if (hash) {
+      result->sections.push_back(
+          {image_hash_section_name, SHT_NOTE, 0, 0, 0, 4, 0,
+           BuildNote(NT_NX2ELF_IMAGE_HASH, std::vector<u8>(hash, hash + 32))});
+    }
+    return true;
+  }
+};
+
+REGISTER_ANALYSIS_PASS(ImageHashPass);
+
+}  // namespace
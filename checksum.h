@@ -0,0 +1,52 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "types.h"
+
+// Per-segment checksums stored in the ELF by the "checksums" pass, in a
+// SHT_NOTE section named .note.nx2elf.checksums with owner "nx2elf":
+//   ChecksumNoteHeader
+//   SegmentChecksum[count]  one per PT_LOAD, in phdr order
+// A segment's hash is XXH64 over the little endian XXH64s of its chunk_size
+// chunks, so chunks can be hashed in parallel.
+#define NT_NX2ELF_CHECKSUMS 1
+inline constexpr char checksum_note_owner[] = "nx2elf";
+inline constexpr char checksum_section_name[] = ".note.nx2elf.checksums";
+
+// Modules without a build id get their identity, the 32 byte BLAKE3 hash of
+// the segment contents, in a note of the same owner named
+// .note.nx2elf.image_hash by the "image_hash" pass.
+#define NT_NX2ELF_IMAGE_HASH 2
+inline constexpr char image_hash_section_name[] = ".note.nx2elf.image_hash";
+
+struct ChecksumNoteHeader {
+  u32 version;
+  u32 chunk_size;
+  u32 count;
+  u32 reserved;
+};
+struct SegmentChecksum {
+  u64 vaddr;
+  u64 size;
+  u64 hash;
+};
+
+struct ChecksumRange {
+  const u8* data;
+  u64 size;
+};
+
+// Hashes every range, splitting all of them into chunk_size chunks which are
+// hashed on up to |jobs| threads.
+std::vector<u64> TreeHashes(const std::vector<ChecksumRange>& ranges,
+                            u32 chunk_size,
+                            unsigned jobs);
+
+// Re-hashes the PT_LOAD contents of an ELF written with checksums and
+// compares them to the stored values. On failure, *error says why.
+bool VerifyElfChecksums(const u8* elf,
+                        size_t size,
+                        unsigned jobs,
+                        std::string* error);
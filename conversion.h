@@ -0,0 +1,120 @@
+#pragma once
+
+#include <string>
+
+#include "analysis.h"
+#include "module_cache.h"
+#include "nso.h"
+#include "types.h"
+
+struct ConvertOptions {
+  const char* elf_path;
+  const char* uncompressed_path;
+  // Prefix for files written by analysis passes; defaults to elf_path
+  const char* analysis_path;
+  unsigned jobs;
+  // Bytes of in-flight conversions in batch mode; 0 derives it from limits
+  u64 memory_budget;
+  bool verbose;
+};
+
+// A single conversion split into phases, so a scheduler may switch to other
+// work between them. Each phase returns false on failure.
+struct Conversion {
+  enum Phase { kLoad, kAnalyze, kWrite, kDone };
+
+  Conversion(const fs::path& path, const ConvertOptions& options)
+      : path(path), options(options) {}
+
+  bool Load() {
+    phase = kAnalyze;
+    if (cache) {
+      std::vector<u8> file;
+      if (cache->Restore(path, &cache_probe, &file, &nso, &passes, &analyzed)) {
+        cached = true;
+        if (!NeedsAnalysis()) {
+          passes.clear();
+          analyzed = false;
+          phase = kWrite;
+        } else if (analyzed) {
+          phase = kWrite;
+        }
+        return true;
+      }
+      if (!file.empty()) {
+        return nso.Load(std::move(file), options.jobs);
+      }
+    }
+    return nso.Load(path, options.jobs);
+  }
+  // Passes only feed the ELF and the analysis artifacts
+  bool NeedsAnalysis() const {
+    return !PassRegistry::Get().passes.empty() &&
+           (options.elf_path || options.analysis_path);
+  }
+  bool Analyze() {
+    phase = kWrite;
+    if (NeedsAnalysis()) {
+      PassRegistry::Get().Run(nso.GetView(), options.jobs, &passes);
+      analyzed = ran_passes = true;
+    }
+    return true;
+  }
+  bool Write() {
+    phase = kDone;
+    bool success = true;
+    if (options.elf_path)
+      success &= nso.WriteElf(fs::path(options.elf_path), &passes);
+
+    if (options.uncompressed_path)
+      success &= nso.WriteUncompressedNso(fs::path(options.uncompressed_path));
+
+    auto analysis_path =
+        options.analysis_path ? options.analysis_path : options.elf_path;
+    for (auto& result : passes) {
+      for (auto& artifact : result.second.artifacts) {
+        if (!analysis_path) {
+          fprintf(stderr, "pass %s: no output path for %s\n",
+                  result.first.c_str(), artifact.suffix.c_str());
+          continue;
+        }
+        success &= File::Write(std::string(analysis_path) + artifact.suffix,
+                               artifact.data);
+      }
+    }
+    // Restored modules go back only if they gained pass results. The module
+    // is handed over, as it is not used after this phase.
+    if (cache && (!cached || ran_passes)) {
+      cache->Insert(path, cache_probe, std::move(nso), std::move(passes),
+                    analyzed);
+    }
+    return success;
+  }
+  bool RunPhase() {
+    switch (phase) {
+    case kLoad:
+      return Load();
+    case kAnalyze:
+      return Analyze();
+    case kWrite:
+      return Write();
+    default:
+      return true;
+    }
+  }
+
+  fs::path path;
+  ConvertOptions options;
+  NsoFile nso;
+  PassResults passes;
+  Phase phase{kLoad};
+  // Optional; shared by conversions of a long running process
+  ModuleCache* cache{};
+  // Identifies the input in |cache|
+  ModuleCache::Probe cache_probe{};
+  // Whether Load restored the module from |cache|
+  bool cached{};
+  // Whether |passes| hold the results of a pass run
+  bool analyzed{};
+  bool ran_passes{};
+};
@@ -0,0 +1,264 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "nso.h"
+#include "types.h"
+
+// Sizes which drive the cost of converting a module, read from its header
+// without loading it.
+struct ModuleFeatures {
+  u64 file_size;
+  // Bytes to LZ4 decode
+  u64 compressed;
+  // Loaded image, without .bss
+  u64 image;
+  // .dynsym entries
+  u64 dynsym;
+};
+
+// Reads the NSO or NRO header of |path|. Other inputs only get their size,
+// which is also their image size.
+inline bool ReadModuleFeatures(const fs::path& path,
+                               ModuleFeatures* features) {
+  std::error_code error;
+  *features = {};
+  features->file_size = fs::file_size(path, error);
+  if (error) {
+    return false;
+  }
+  features->image = features->file_size;
+  u8 head[sizeof(NsoFile::NsoHeader)]{};
+  auto f = File::Open(path, "rb");
+  size_t len = f ? fread(head, 1, sizeof(head), f.get()) : 0;
+  const size_t nro_offset = ALIGN_UP(sizeof(NsoFile::ModPointer), 0x10);
+  if (len >= sizeof(NsoFile::NsoHeader) &&
+      !memcmp(head, NsoFile::nso_magic.data(), NsoFile::nso_magic.size())) {
+    auto header = reinterpret_cast<const NsoFile::NsoHeader*>(head);
+    features->image = 0;
+    for (int i = 0; i < NsoFile::kNumSegment; i++) {
+      auto& seg = header->segments[i];
+      features->image =
+          std::max(features->image, u64(seg.mem_offset) + seg.mem_size);
+      if (header->flags & (1 << i)) {
+        features->compressed += header->segment_file_sizes[i];
+      }
+    }
+    features->dynsym = header->dynsym.size / sizeof(Elf64_Sym);
+  } else if (len >= nro_offset + sizeof(NsoFile::NroHeader) &&
+             !memcmp(&head[nro_offset], NsoFile::nro_magic.data(),
+                     NsoFile::nro_magic.size())) {
+    auto header =
+        reinterpret_cast<const NsoFile::NroHeader*>(&head[nro_offset]);
+    features->dynsym = header->dynsym.size / sizeof(Elf64_Sym);
+  }
+  return true;
+}
+
+// Linear model of the CPU time and peak memory of converting a module, in
+// the terms below. Coefficients come from --bench-cost on a representative
+// corpus; the defaults are rough figures for a current x86-64 core.
+struct CostModel {
+  enum Term { kConstant, kFileSize, kCompressed, kImage, kDynsym, kNumTerms };
+  static constexpr const char* term_names[kNumTerms] = {
+      "constant", "file_size", "compressed", "image", "dynsym"};
+
+  struct Sample {
+    ModuleFeatures features;
+    double cpu_seconds;
+    double memory;
+  };
+
+  static CostModel Default() {
+    CostModel model{};
+    // LZ4 at about 1 GB/s, passes and the ELF at about 200 MB/s
+    model.cpu = {1e-3, 0, 1e-9, 5e-9, 2e-7};
+    // The image and the ELF, which is about as large as the image, plus the
+    // compressed NSO segments being decoded. Other inputs become the image.
+    model.memory = {0, 0, 1, 2, 0};
+    return model;
+  }
+
+  static std::array<double, kNumTerms> Terms(const ModuleFeatures& f) {
+    return {1, double(f.file_size), double(f.compressed), double(f.image),
+            double(f.dynsym)};
+  }
+  static double Predict(const std::array<double, kNumTerms>& coefficients,
+                        const ModuleFeatures& features) {
+    auto terms = Terms(features);
+    double sum = 0;
+    for (int i = 0; i < kNumTerms; i++) {
+      sum += coefficients[i] * terms[i];
+    }
+    return std::max(sum, 0.0);
+  }
+  double PredictCpu(const ModuleFeatures& features) const {
+    return Predict(cpu, features);
+  }
+  u64 PredictMemory(const ModuleFeatures& features) const {
+    return static_cast<u64>(Predict(memory, features));
+  }
+
+  // Least squares fit of both models to |samples|. Terms which would get a
+  // negative coefficient are dropped, so costs never shrink as a module
+  // grows.
+  static CostModel Fit(const std::vector<Sample>& samples) {
+    CostModel model{};
+    model.cpu =
+        FitTerms(samples, [](const Sample& s) { return s.cpu_seconds; });
+    model.memory =
+        FitTerms(samples, [](const Sample& s) { return s.memory; });
+    return model;
+  }
+
+  // "cpu" and "memory" lines with the coefficients of each term
+  bool Save(const fs::path& path) const {
+    auto f = File::Open(path, "w");
+    if (!f) {
+      return false;
+    }
+    fputs("# terms:", f.get());
+    for (auto name : term_names) {
+      fprintf(f.get(), " %s", name);
+    }
+    fputs("\n", f.get());
+    auto line = [&f](const char* name,
+                     const std::array<double, kNumTerms>& coefficients) {
+      fputs(name, f.get());
+      for (double c : coefficients) {
+        fprintf(f.get(), " %.9g", c);
+      }
+      fputs("\n", f.get());
+    };
+    line("cpu", cpu);
+    line("memory", memory);
+    return true;
+  }
+  bool Load(const fs::path& path) {
+    auto f = File::Open(path, "r");
+    if (!f) {
+      return false;
+    }
+    bool has_cpu = false, has_memory = false;
+    char line[512];
+    while (fgets(line, sizeof(line), f.get())) {
+      static_assert(kNumTerms == 5, "the format below lists every term");
+      std::array<double, kNumTerms> c;
+      char name[16];
+      if (sscanf(line, "%15s %lf %lf %lf %lf %lf", name, &c[0], &c[1], &c[2],
+                 &c[3], &c[4]) != 1 + kNumTerms) {
+        continue;
+      }
+      if (!strcmp(name, "cpu")) {
+        cpu = c;
+        has_cpu = true;
+      } else if (!strcmp(name, "memory")) {
+        memory = c;
+        has_memory = true;
+      }
+    }
+    return has_cpu && has_memory;
+  }
+
+  std::array<double, kNumTerms> cpu;
+  std::array<double, kNumTerms> memory;
+
+ private:
+  template <typename Target>
+  static std::array<double, kNumTerms> FitTerms(
+      const std::vector<Sample>& samples,
+      Target target) {
+    std::array<double, kNumTerms> coefficients{};
+    bool active[kNumTerms];
+    std::fill(active, active + kNumTerms, true);
+    for (;;) {
+      // Columns are scaled to unit RMS, as byte counts dwarf the constant
+      double scale[kNumTerms]{};
+      for (auto& sample : samples) {
+        auto terms = Terms(sample.features);
+        for (int i = 0; i < kNumTerms; i++) {
+          scale[i] += terms[i] * terms[i];
+        }
+      }
+      std::vector<int> used;
+      for (int i = 0; i < kNumTerms; i++) {
+        scale[i] = std::sqrt(scale[i] / std::max<size_t>(samples.size(), 1));
+        if (active[i] && scale[i] > 0) {
+          used.push_back(i);
+        }
+      }
+      // Normal equations with a little ridge, since sizes are correlated
+      size_t n = used.size();
+      std::vector<double> a(n * (n + 1));
+      for (auto& sample : samples) {
+        auto terms = Terms(sample.features);
+        double y = target(sample);
+        for (size_t r = 0; r < n; r++) {
+          double x = terms[used[r]] / scale[used[r]];
+          for (size_t c = 0; c < n; c++) {
+            a[r * (n + 1) + c] += x * terms[used[c]] / scale[used[c]];
+          }
+          a[r * (n + 1) + n] += x * y;
+        }
+      }
+      for (size_t r = 0; r < n; r++) {
+        a[r * (n + 1) + r] += 1e-9 * samples.size();
+      }
+      std::vector<double> solution = Solve(a, n);
+      coefficients = {};
+      bool negative = false;
+      for (size_t r = 0; r < n; r++) {
+        double c = solution[r] / scale[used[r]];
+        if (c < 0) {
+          active[used[r]] = false;
+          negative = true;
+        }
+        coefficients[used[r]] = c;
+      }
+      if (!negative) {
+        return coefficients;
+      }
+    }
+  }
+
+  // Gaussian elimination with partial pivoting on the n x (n + 1) augmented
+  // matrix |a|
+  static std::vector<double> Solve(std::vector<double> a, size_t n) {
+    auto at = [&a, n](size_t r, size_t c) -> double& {
+      return a[r * (n + 1) + c];
+    };
+    for (size_t col = 0; col < n; col++) {
+      size_t pivot = col;
+      for (size_t r = col + 1; r < n; r++) {
+        if (std::fabs(at(r, col)) > std::fabs(at(pivot, col))) {
+          pivot = r;
+        }
+      }
+      for (size_t c = 0; c <= n; c++) {
+        std::swap(at(col, c), at(pivot, c));
+      }
+      if (at(col, col) == 0) {
+        continue;
+      }
+      for (size_t r = 0; r < n; r++) {
+        if (r == col) {
+          continue;
+        }
+        double factor = at(r, col) / at(col, col);
+        for (size_t c = col; c <= n; c++) {
+          at(r, c) -= factor * at(col, c);
+        }
+      }
+    }
+    std::vector<double> x(n);
+    for (size_t r = 0; r < n; r++) {
+      x[r] = at(r, r) ? at(r, n) / at(r, r) : 0;
+    }
+    return x;
+  }
+};
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdlib>
+#include <filesystem>
+#include <memory>
+
+#include "io_limit.h"
+#include "types.h"
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace File {
+
+// Outputs at least this large bypass the page cache; 0 disables it.
+inline u64 direct_write_min = 64 << 20;
+
+#ifdef __linux__
+// Writes |size| bytes to |path| without filling the page cache, so large
+// outputs don't evict the inputs of other conversions. The file is
+// preallocated, then whole blocks are copied through an aligned buffer and
+// written with O_DIRECT. The unaligned tail, and everything on filesystems
+// which reject O_DIRECT, is written buffered.
+inline bool WriteDirect(const std::filesystem::path& path,
+                        const u8* data,
+                        size_t size,
+                        IoLimiter* limiter) {
+  const size_t align = 4096;
+  int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+  int fd = open(path.c_str(), flags | O_DIRECT, 0666);
+  bool direct = fd >= 0;
+  if (!direct) {
+    fd = open(path.c_str(), flags, 0666);
+    if (fd < 0) {
+      return false;
+    }
+  }
+  // Only an optimization; not all filesystems support it
+  if (size) {
+    fallocate(fd, 0, 0, size);
+  }
+  size_t chunk_size = ALIGN_UP(limiter ? limiter->chunk_size : 1 << 20, align);
+  auto write_all = [&](const u8* p, size_t len, u64 offset) {
+    if (limiter) {
+      limiter->Acquire(len, true);
+    }
+    while (len) {
+      ssize_t n = pwrite(fd, p, len, offset);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        return false;
+      }
+      p += n;
+      len -= n;
+      offset += n;
+    }
+    return true;
+  };
+
+  size_t done = 0;
+  if (direct) {
+    std::unique_ptr<void, decltype(&free)> buffer(nullptr, free);
+    void* p;
+    if (!posix_memalign(&p, align, chunk_size)) {
+      buffer.reset(p);
+    }
+    size_t aligned_size = buffer ? ALIGN_DOWN(size, align) : 0;
+    while (done < aligned_size) {
+      size_t len = std::min(aligned_size - done, chunk_size);
+      memcpy(buffer.get(), &data[done], len);
+      if (!write_all(static_cast<const u8*>(buffer.get()), len, done)) {
+        if (errno != EINVAL) {
+          close(fd);
+          return false;
+        }
+        // Rejected alignment or O_DIRECT itself: finish buffered
+        break;
+      }
+      done += len;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+  }
+  while (done < size) {
+    size_t len = std::min(size - done, chunk_size);
+    if (!write_all(&data[done], len, done)) {
+      close(fd);
+      return false;
+    }
+    done += len;
+  }
+  return close(fd) == 0;
+}
+#endif
+
+}  // namespace File
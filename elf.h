@@ -66,6 +66,7 @@ struct Elf64_Phdr {
 #define PT_NULL 0
 #define PT_LOAD 1
 #define PT_DYNAMIC 2
+#define PT_NOTE 4
 #define PT_LOOS 0x60000000ul
 #define PT_HIOS 0x6ffffffful
 #define PT_LOPROC 0x70000000ul
@@ -196,6 +197,9 @@ struct Elf64_Rela {
 #define ELF64_R_SYM(i) u32((i) >> 32)
 #define ELF64_R_TYPE(i) u32(i)
 
+/* Static relocations also seen in .rela.dyn */
+#define R_AARCH64_ABS64 257 /* Direct 64 bit.  */
+
 /* Dynamic relocations */
 #define R_AARCH64_COPY 1024
 #define R_AARCH64_GLOB_DAT 1025  /* Create GOT entry.  */
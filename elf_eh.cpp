@@ -1,30 +1,13 @@
+#include <algorithm>
 #include <cstdio>
+#include <memory>
+#include <string>
 
 #include "elf_eh.h"
+#include "parallel.h"
 #include "types.h"
 #include <cstdio>
 
-#define DW_EH_PE_absptr 0x00
-#define DW_EH_PE_omit 0xff
-
-#define DW_EH_PE_uleb128 0x01
-#define DW_EH_PE_udata2 0x02
-#define DW_EH_PE_udata4 0x03
-#define DW_EH_PE_udata8 0x04
-#define DW_EH_PE_sleb128 0x09
-#define DW_EH_PE_sdata2 0x0A
-#define DW_EH_PE_sdata4 0x0B
-#define DW_EH_PE_sdata8 0x0C
-#define DW_EH_PE_signed 0x08
-
-#define DW_EH_PE_pcrel 0x10
-#define DW_EH_PE_textrel 0x20
-#define DW_EH_PE_datarel 0x30
-#define DW_EH_PE_funcrel 0x40
-#define DW_EH_PE_aligned 0x50
-
-#define DW_EH_PE_indirect 0x80
-
 bool ElfEHInfo::MeasureFrame(const eh_frame_hdr* hdr,
                              uintptr_t* eh_frame_ptr,
                              u64* eh_frame_len) {
@@ -106,3 +89,192 @@ bool ElfEHInfo::MeasureFrame(const eh_frame_hdr* hdr,
   }
   return true;
 }
+
+namespace {
+
+// What a CIE tells about parsing its FDEs
+struct EhCieInfo {
+  bool ok;
+  // 'z' augmentation: FDEs carry augmentation data
+  bool has_augmentation;
+  u8 fde_enc;
+  u8 lsda_enc;
+};
+
+EhCieInfo ParseCie(const ImageView& view, u64 addr) {
+  EhCieInfo info{false, false, DW_EH_PE_absptr, DW_EH_PE_omit};
+  EhReader r(view, addr, view.image_size);
+  u32 len = r.Raw<u32>();
+  if (!r.ok || len == 0 || len == 0xffffffff) {
+    return info;
+  }
+  r.end = std::min(r.end, r.pos + len);
+  u32 cie_id = r.Raw<u32>();
+  u8 version = r.Raw<u8>();
+  if (cie_id != 0) {
+    return info;
+  }
+  std::string augmentation;
+  for (char c; r.ok && (c = r.Raw<char>());) {
+    augmentation += c;
+  }
+  r.Uleb();  // code alignment
+  r.Sleb();  // data alignment
+  if (version == 1) {
+    r.Raw<u8>();  // return address register
+  } else {
+    r.Uleb();
+  }
+  if (!augmentation.empty() && augmentation[0] == 'z') {
+    info.has_augmentation = true;
+    r.Uleb();  // augmentation data length
+    for (size_t i = 1; i < augmentation.size() && r.ok; i++) {
+      switch (augmentation[i]) {
+      case 'L':
+        info.lsda_enc = r.Raw<u8>();
+        break;
+      case 'P':
+        r.Pointer(r.Raw<u8>());
+        break;
+      case 'R':
+        info.fde_enc = r.Raw<u8>();
+        break;
+      case 'S':
+      case 'B':
+        break;
+      default:
+        // Unknown data; L and R normally come first anyway
+        i = augmentation.size();
+        break;
+      }
+    }
+  } else if (!augmentation.empty()) {
+    return info;
+  }
+  info.ok = r.ok;
+  return info;
+}
+
+bool ParseFde(const ImageView& view, u64 addr, EhFde* fde) {
+  EhReader r(view, addr, view.image_size);
+  u32 len = r.Raw<u32>();
+  if (!r.ok || len == 0 || len == 0xffffffff) {
+    return false;
+  }
+  r.end = std::min(r.end, r.pos + len);
+  u64 cie_pointer_addr = r.pos;
+  u32 cie_pointer = r.Raw<u32>();
+  if (!r.ok || cie_pointer == 0 || cie_pointer > cie_pointer_addr) {
+    return false;
+  }
+  auto cie = ParseCie(view, cie_pointer_addr - cie_pointer);
+  if (!cie.ok) {
+    return false;
+  }
+  fde->addr = addr;
+  fde->pc_begin = r.Pointer(cie.fde_enc);
+  fde->pc_end = fde->pc_begin + r.Value(cie.fde_enc);
+  fde->lsda = 0;
+  if (cie.has_augmentation) {
+    r.Uleb();  // augmentation data length
+    fde->lsda = r.Pointer(cie.lsda_enc);
+  }
+  return r.ok;
+}
+
+size_t EncodedSize(u8 enc) {
+  switch (enc & 0x0f) {
+  case DW_EH_PE_udata2:
+  case DW_EH_PE_sdata2:
+    return 2;
+  case DW_EH_PE_udata4:
+  case DW_EH_PE_sdata4:
+    return 4;
+  case DW_EH_PE_absptr:
+  case DW_EH_PE_udata8:
+  case DW_EH_PE_sdata8:
+    return 8;
+  default:
+    return 0;
+  }
+}
+
+}  // namespace
+
+bool ParseEhFrameHdr(const ImageView& view, unsigned jobs, EhFdes* fdes) {
+  u64 hdr = view.eh_frame_hdr_addr;
+  if (!view.eh_frame_hdr_size) {
+    return false;
+  }
+  EhReader r(view, hdr, hdr + view.eh_frame_hdr_size);
+  u8 version = r.Raw<u8>();
+  u8 eh_frame_ptr_enc = r.Raw<u8>();
+  u8 fde_count_enc = r.Raw<u8>();
+  u8 table_enc = r.Raw<u8>();
+  if (!r.ok || version != 1) {
+    return false;
+  }
+  r.Pointer(eh_frame_ptr_enc, hdr);
+  u64 fde_count = r.Pointer(fde_count_enc, hdr);
+  // The binary search table has fixed size entries
+  size_t entry_size = 2 * EncodedSize(table_enc);
+  if (!r.ok || !entry_size || fde_count > (r.end - r.pos) / entry_size) {
+    return false;
+  }
+  u64 table = r.pos;
+  std::vector<EhFde> all(fde_count);
+  std::vector<u8> parsed(fde_count);
+  ParallelFor(fde_count, jobs, [&](size_t i) {
+    EhReader entry(view, table + i * entry_size, r.end);
+    entry.Pointer(table_enc, hdr);  // initial location
+    u64 fde_addr = entry.Pointer(table_enc, hdr);
+    parsed[i] = entry.ok && ParseFde(view, fde_addr, &all[i]);
+  });
+  fdes->clear();
+  for (size_t i = 0; i < all.size(); i++) {
+    if (parsed[i]) {
+      fdes->push_back(all[i]);
+    }
+  }
+  return true;
+}
+
+u64 EhFrameAddr(const ImageView& view) {
+  u64 hdr = view.eh_frame_hdr_addr;
+  if (!view.eh_frame_hdr_size) {
+    return 0;
+  }
+  EhReader r(view, hdr, hdr + view.eh_frame_hdr_size);
+  u8 version = r.Raw<u8>();
+  u8 eh_frame_ptr_enc = r.Raw<u8>();
+  r.Raw<u8>();  // fde_count_enc
+  r.Raw<u8>();  // table_enc
+  u64 eh_frame = r.Pointer(eh_frame_ptr_enc, hdr);
+  return r.ok && version == 1 ? eh_frame : 0;
+}
+
+namespace {
+
+// Shares the parsed FDEs (an EhFdes, sorted by pc_begin) with other passes.
+// Modules without a usable .eh_frame_hdr just have no FDEs.
+class EhFramePass : public AnalysisPass {
+ public:
+  const char* Name() const override { return "eh_frame"; }
+  bool Run(const PassContext& ctx, PassResult* result) override {
+    auto fdes = std::make_shared<EhFdes>();
+    if (ctx.view.eh_frame_hdr_size &&
+        !ParseEhFrameHdr(ctx.view, ctx.jobs, fdes.get())) {
+      fputs("unsupported .eh_frame_hdr\n", stderr);
+    }
+    std::sort(fdes->begin(), fdes->end(),
+              [](const EhFde& a, const EhFde& b) {
+                return a.pc_begin < b.pc_begin;
+              });
+    result->data = fdes;
+    return true;
+  }
+};
+
+REGISTER_ANALYSIS_PASS(EhFramePass);
+
+}  // namespace
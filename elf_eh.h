@@ -1,7 +1,32 @@
 #pragma once
 
+#include <algorithm>
+#include <vector>
+
+#include "analysis.h"
 #include "types.h"
 
+#define DW_EH_PE_absptr 0x00
+#define DW_EH_PE_omit 0xff
+
+#define DW_EH_PE_uleb128 0x01
+#define DW_EH_PE_udata2 0x02
+#define DW_EH_PE_udata4 0x03
+#define DW_EH_PE_udata8 0x04
+#define DW_EH_PE_sleb128 0x09
+#define DW_EH_PE_sdata2 0x0A
+#define DW_EH_PE_sdata4 0x0B
+#define DW_EH_PE_sdata8 0x0C
+#define DW_EH_PE_signed 0x08
+
+#define DW_EH_PE_pcrel 0x10
+#define DW_EH_PE_textrel 0x20
+#define DW_EH_PE_datarel 0x30
+#define DW_EH_PE_funcrel 0x40
+#define DW_EH_PE_aligned 0x50
+
+#define DW_EH_PE_indirect 0x80
+
 struct eh_frame_hdr {
   u8 version;
   u8 eh_frame_ptr_enc;
@@ -36,3 +61,133 @@ struct eh_fde_rel {
 struct ElfEHInfo {
 	bool MeasureFrame(const eh_frame_hdr *hdr, uintptr_t *eh_frame_ptr, u64 *eh_frame_len);
 };
+
+// Bounds-checked reader of DWARF EH data at image addresses. Reading past end
+// clears ok and yields 0.
+struct EhReader {
+  EhReader(const ImageView& view, u64 pos, u64 end)
+      : view(view), pos(pos), end(std::min<u64>(end, view.image_size)) {}
+
+  template <typename T>
+  T Raw() {
+    T val{};
+    if (!ok || pos > end || end - pos < sizeof(T)) {
+      ok = false;
+      return val;
+    }
+    memcpy(&val, &view.image[pos], sizeof(T));
+    pos += sizeof(T);
+    return val;
+  }
+  u64 Uleb() {
+    u64 val = 0;
+    for (int shift = 0;; shift += 7) {
+      u8 b = Raw<u8>();
+      if (!ok) {
+        return 0;
+      }
+      if (shift < 64) {
+        val |= static_cast<u64>(b & 0x7f) << shift;
+      }
+      if (!(b & 0x80)) {
+        return val;
+      }
+    }
+  }
+  s64 Sleb() {
+    u64 val = 0;
+    int shift = 0;
+    u8 b;
+    do {
+      b = Raw<u8>();
+      if (!ok) {
+        return 0;
+      }
+      if (shift < 64) {
+        val |= static_cast<u64>(b & 0x7f) << shift;
+      }
+      shift += 7;
+    } while (b & 0x80);
+    if (shift < 64 && (b & 0x40)) {
+      val |= ~0ull << shift;
+    }
+    return static_cast<s64>(val);
+  }
+  // Value in the format of |enc| without applying its base.
+  u64 Value(u8 enc) {
+    switch (enc & 0x0f) {
+    case DW_EH_PE_absptr:
+    case DW_EH_PE_udata8:
+    case DW_EH_PE_sdata8:
+      return Raw<u64>();
+    case DW_EH_PE_uleb128:
+      return Uleb();
+    case DW_EH_PE_udata2:
+      return Raw<u16>();
+    case DW_EH_PE_udata4:
+      return Raw<u32>();
+    case DW_EH_PE_sleb128:
+      return Sleb();
+    case DW_EH_PE_sdata2:
+      return static_cast<u64>(static_cast<s64>(Raw<s16>()));
+    case DW_EH_PE_sdata4:
+      return static_cast<u64>(static_cast<s64>(Raw<s32>()));
+    default:
+      ok = false;
+      return 0;
+    }
+  }
+  // Pointer encoded as |enc|. Like the unwinder, a raw 0 stays 0 (no
+  // pointer). Indirect pointers are not followed; the address of the slot is
+  // returned.
+  u64 Pointer(u8 enc, u64 data_base = 0, u64 func_base = 0) {
+    if (enc == DW_EH_PE_omit) {
+      return 0;
+    }
+    if ((enc & 0x70) == DW_EH_PE_aligned) {
+      pos = ALIGN_UP(pos, sizeof(u64));
+      return Raw<u64>();
+    }
+    u64 base = pos;
+    u64 val = Value(enc);
+    if (!val) {
+      return 0;
+    }
+    switch (enc & 0x70) {
+    case DW_EH_PE_absptr:
+      return val;
+    case DW_EH_PE_pcrel:
+      return base + val;
+    case DW_EH_PE_datarel:
+      return data_base + val;
+    case DW_EH_PE_funcrel:
+      return func_base + val;
+    default:
+      ok = false;
+      return 0;
+    }
+  }
+
+  const ImageView& view;
+  u64 pos;
+  u64 end;
+  bool ok{true};
+};
+
+struct EhFde {
+  // Address of the FDE record
+  u64 addr;
+  u64 pc_begin;
+  u64 pc_end;
+  // 0 if the FDE has no LSDA
+  u64 lsda;
+};
+
+typedef std::vector<EhFde> EhFdes;
+
+// Parses the FDEs listed in the .eh_frame_hdr search table on up to |jobs|
+// threads. FDEs which fail to parse are dropped.
+bool ParseEhFrameHdr(const ImageView& view, unsigned jobs, EhFdes* fdes);
+
+// Start of .eh_frame according to .eh_frame_hdr, or 0.
+u64 EhFrameAddr(const ImageView& view);
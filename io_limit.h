@@ -0,0 +1,96 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <mutex>
+#include <thread>
+
+#include "types.h"
+
+// Token buckets limiting the bandwidth and operation rate of File::Read and
+// File::Write. Transfers are split into chunk_size operations. A rate of 0
+// means unlimited.
+struct IoLimiter {
+  typedef std::chrono::steady_clock Clock;
+
+  IoLimiter(double bytes_per_sec, double ops_per_sec)
+      : bandwidth{bytes_per_sec, bytes_per_sec},
+        iops{ops_per_sec, ops_per_sec},
+        start(Clock::now()),
+        last(start) {}
+
+  // Blocks until an operation of |bytes| may proceed.
+  void Acquire(u64 bytes, bool write) {
+    double wait, scale;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto now = Clock::now();
+      double elapsed = std::chrono::duration<double>(now - last).count();
+      last = now;
+      scale = std::ldexp(1.0, scale_shift.load());
+      wait = std::max(bandwidth.Take(bytes, elapsed, scale),
+                      iops.Take(1, elapsed, scale));
+    }
+    // Sleep in slices so limits changed meanwhile apply to waiting threads
+    while (wait > 0) {
+      double slice = std::min(wait, 0.1);
+      std::this_thread::sleep_for(std::chrono::duration<double>(slice));
+      throttled_us += static_cast<u64>(slice * 1e6);
+      wait -= slice;
+      double new_scale = std::ldexp(1.0, scale_shift.load());
+      wait *= scale / new_scale;
+      scale = new_scale;
+    }
+    (write ? write_bytes : read_bytes) += bytes;
+    (write ? write_ops : read_ops)++;
+  }
+
+  // Prints achieved rates since construction.
+  void DumpStats(FILE* f) const {
+    double elapsed =
+        std::chrono::duration<double>(Clock::now() - start).count();
+    elapsed = std::max(elapsed, 1e-9);
+    const double mb = 1024 * 1024;
+    fprintf(f,
+            "io: read %.1f MB (%.1f MB/s, %.0f ops/s), wrote %.1f MB "
+            "(%.1f MB/s, %.0f ops/s), threads waited %.2fs over %.2fs\n",
+            read_bytes / mb, read_bytes / mb / elapsed, read_ops / elapsed,
+            write_bytes / mb, write_bytes / mb / elapsed, write_ops / elapsed,
+            throttled_us / 1e6, elapsed);
+  }
+
+  struct Bucket {
+    // Returns how long the caller must wait for n tokens. Tokens may go
+    // negative, which queues later callers behind this one.
+    double Take(double n, double elapsed, double scale) {
+      if (rate <= 0) {
+        return 0;
+      }
+      double scaled_rate = rate * scale;
+      // allow bursts of up to one second
+      tokens = std::min(tokens + elapsed * scaled_rate, scaled_rate);
+      tokens -= n;
+      return tokens < 0 ? -tokens / scaled_rate : 0;
+    }
+    double rate;
+    double tokens;
+  };
+
+  Bucket bandwidth;
+  Bucket iops;
+  // Rates are multiplied by 2^scale_shift; adjusted at runtime by signals.
+  std::atomic<int> scale_shift{0};
+  size_t chunk_size{1 << 20};
+
+  std::atomic<u64> read_bytes{0};
+  std::atomic<u64> write_bytes{0};
+  std::atomic<u64> read_ops{0};
+  std::atomic<u64> write_ops{0};
+  std::atomic<u64> throttled_us{0};
+
+  Clock::time_point start;
+  Clock::time_point last;
+  std::mutex mutex;
+};
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+
+// Returns |str| as a quoted JSON string literal.
+inline std::string JsonString(const char* str) {
+  std::string out("\"");
+  for (; *str; str++) {
+    unsigned char c = *str;
+    switch (c) {
+    case '"':
+      out += "\\\"";
+      break;
+    case '\\':
+      out += "\\\\";
+      break;
+    case '\n':
+      out += "\\n";
+      break;
+    case '\r':
+      out += "\\r";
+      break;
+    case '\t':
+      out += "\\t";
+      break;
+    default:
+      if (c < 0x20) {
+        char buf[8];
+        snprintf(buf, sizeof(buf), "\\u%04x", c);
+        out += buf;
+      } else {
+        out += c;
+      }
+      break;
+    }
+  }
+  out += '"';
+  return out;
+}
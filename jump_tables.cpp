@@ -0,0 +1,305 @@
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "aarch64.h"
+#include "analysis.h"
+#include "parallel.h"
+#include "types.h"
+
+namespace {
+
+struct JumpTable {
+  // Address of the BR
+  u64 branch;
+  u64 table;
+  u32 entry_size;
+  // Targets are base + (entry << shift)
+  u64 base;
+  u32 shift;
+  std::vector<u64> targets;
+};
+typedef std::vector<JumpTable> JumpTables;
+
+// Recognizes the switch idioms compilers emit for AArch64:
+//   cmp   wIdx, #max           ; bound, with b.hi/b.hs to the default case
+//   b.hi  default
+//   adrp  xTab, table          ; or adr
+//   add   xTab, xTab, :lo12:table
+//   ldrb  wEnt, [xTab, xIdx]   ; ldrh/ldrsw ..., lsl #1/#2
+//   adr   xBase, anchor        ; or the table itself
+//   add   xDst, xBase, wEnt, sxtb #2
+//   br    xDst
+// Instructions may be interleaved with others, but must be in one block.
+class JumpTableMatcher {
+ public:
+  explicit JumpTableMatcher(const ImageView& view)
+      : view_(view), text_(view.segments[ImageView::kText]) {}
+
+  bool Match(u64 br, JumpTable* table) {
+    u64 add_at, load_at;
+    A64::Extend extend;
+    u32 shift, entry_size;
+    bool is_signed;
+    u32 insn = Insn(br);
+    if (!FindDef(A64::Rn(insn), br, &add_at) ||
+        !A64::IsAddReg(Insn(add_at), &extend, &shift)) {
+      return false;
+    }
+    u32 add = Insn(add_at);
+    if (!FindDef(A64::Rm(add), add_at, &load_at) ||
+        !A64::IsLdrReg(Insn(load_at), &entry_size, &is_signed)) {
+      return false;
+    }
+    u32 load = Insn(load_at);
+    // The index must be scaled by the entry size, as the stride is otherwise
+    // unknown
+    bool scaled = (load >> 12) & 1;
+    if (entry_size > 4 || (entry_size > 1 && !scaled)) {
+      return false;
+    }
+    u64 count;
+    if (!ResolveAddress(A64::Rn(load), load_at, 0, &table->table) ||
+        !ResolveAddress(A64::Rn(add), add_at, 0, &table->base) ||
+        !FindBound(A64::Rm(load), br, load_at, &count)) {
+      return false;
+    }
+    auto entries = view_.Ptr<u8>(table->table, count * entry_size);
+    if (!entries || view_.SegmentOf(table->table) == ImageView::kText) {
+      return false;
+    }
+    table->branch = br;
+    table->entry_size = entry_size;
+    table->shift = shift;
+    table->targets.clear();
+    for (u64 i = 0; i < count; i++) {
+      u64 entry = 0;
+      memcpy(&entry, &entries[i * entry_size], entry_size);
+      if (is_signed) {
+        entry = A64::SignExtend(entry, entry_size * 8);
+      }
+      entry = Extend(entry, extend);
+      u64 target = table->base + (entry << shift);
+      if (target < text_.addr || target >= text_.addr + text_.size ||
+          target % 4) {
+        return false;
+      }
+      table->targets.push_back(target);
+    }
+    return true;
+  }
+
+ private:
+  // Bounds the search for defining instructions
+  static const int kWindow = 32;
+  static const u64 kMaxEntries = 4096;
+
+  u32 Insn(u64 addr) const {
+    u32 insn;
+    memcpy(&insn, &view_.image[addr], sizeof(insn));
+    return insn;
+  }
+
+  // Finds the closest instruction before |from| in the same block which
+  // writes |reg|.
+  bool FindDef(u32 reg, u64 from, u64* at) const {
+    for (int i = 0; i < kWindow && from >= text_.addr + 4; i++) {
+      from -= 4;
+      u32 insn = Insn(from);
+      if (A64::IsRet(insn) || A64::IsBr(insn) ||
+          (A64::IsB(insn) && !A64::IsBl(insn))) {
+        return false;
+      }
+      // Calls clobber the argument, temporary and link registers
+      if (A64::IsBl(insn) && (reg <= 18 || reg == 30)) {
+        return false;
+      }
+      if (!A64::KeepsRd(insn) && A64::Rd(insn) == reg) {
+        *at = from;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Resolves an address materialized by ADR, or ADRP + ADD.
+  bool ResolveAddress(u32 reg, u64 from, int depth, u64* value) const {
+    u64 at, imm;
+    if (depth > 2 || !FindDef(reg, from, &at)) {
+      return false;
+    }
+    u32 insn = Insn(at);
+    if (A64::IsAdr(insn, at, value)) {
+      return true;
+    }
+    if (A64::IsAddImm(insn, &imm) &&
+        ResolveAddress(A64::Rn(insn), at, depth + 1, value)) {
+      *value += imm;
+      return true;
+    }
+    return false;
+  }
+
+  // Finds "cmp wIdx, #max" guarded by a conditional branch before |br| and
+  // returns the number of table entries it allows.
+  bool FindBound(u32 index, u64 br, u64 load_at, u64* count) const {
+    bool have_cond = false;
+    A64::Cond cond;
+    u64 addr = br;
+    for (int i = 0; i < kWindow && addr >= text_.addr + 4; i++) {
+      addr -= 4;
+      u32 insn = Insn(addr);
+      A64::Cond c;
+      u64 imm;
+      if (!have_cond && A64::IsBCond(insn, &c)) {
+        if (c != A64::kHi && c != A64::kLs && c != A64::kHs &&
+            c != A64::kLo) {
+          return false;
+        }
+        have_cond = true;
+        cond = c;
+      } else if (have_cond && A64::IsCmpImm(insn, &imm) &&
+                 A64::Rn(insn) == index) {
+        *count = cond == A64::kHi || cond == A64::kLs ? imm + 1 : imm;
+        return *count && *count <= kMaxEntries;
+      } else if (A64::IsRet(insn) || A64::IsBr(insn) ||
+                 (A64::IsB(insn) && !A64::IsBl(insn))) {
+        return false;
+      } else if (addr < load_at && !A64::KeepsRd(insn) &&
+                 A64::Rd(insn) == index) {
+        // Follow register moves of the index back to the compare
+        if (!A64::IsMovReg(insn)) {
+          return false;
+        }
+        index = A64::Rm(insn);
+      }
+    }
+    return false;
+  }
+
+  static u64 Extend(u64 val, A64::Extend extend) {
+    switch (extend) {
+    case A64::kUxtb:
+      return val & 0xff;
+    case A64::kUxth:
+      return val & 0xffff;
+    case A64::kUxtw:
+      return val & 0xffffffff;
+    case A64::kSxtb:
+      return A64::SignExtend(val, 8);
+    case A64::kSxth:
+      return A64::SignExtend(val, 16);
+    case A64::kSxtw:
+      return A64::SignExtend(val, 32);
+    default:
+      return val;
+    }
+  }
+
+  const ImageView& view_;
+  const ImageView::Segment& text_;
+};
+
+std::string FormatIndex(const JumpTables& tables) {
+  std::string out("[");
+  char buf[256];
+  for (size_t i = 0; i < tables.size(); i++) {
+    auto& table = tables[i];
+    snprintf(buf, sizeof(buf),
+             "%s\n{\"branch\":%" PRIu64 ",\"table\":%" PRIu64
+             ",\"entry_size\":%u,\"count\":%zu,\"base\":%" PRIu64
+             ",\"shift\":%u,\"targets\":[",
+             i ? "," : "", table.branch, table.table, table.entry_size,
+             table.targets.size(), table.base, table.shift);
+    out += buf;
+    for (size_t j = 0; j < table.targets.size(); j++) {
+      snprintf(buf, sizeof(buf), "%s%" PRIu64, j ? "," : "", table.targets[j]);
+      out += buf;
+    }
+    out += "]}";
+  }
+  out += "\n]\n";
+  return out;
+}
+
+// Recovers switch jump tables from .text/.rodata and writes them to
+// <output>.jumptables.json. The tables are shared with dependent passes.
+class JumpTablePass : public AnalysisPass {
+ public:
+  const char* Name() const override { return "jump_tables"; }
+  bool Run(const PassContext& ctx, PassResult* result) override {
+    auto& view = ctx.view;
+    auto& text = view.segments[ImageView::kText];
+    if (!view.Contains(text.addr, text.size)) {
+      return false;
+    }
+    // Scan in chunks; each BR is matched independently
+    const u64 chunk_size = 0x10000;
+    size_t num_chunks = (text.size + chunk_size - 1) / chunk_size;
+    std::vector<JumpTables> found(num_chunks);
+    ParallelFor(num_chunks, ctx.jobs, [&](size_t i) {
+      JumpTableMatcher matcher(view);
+      u64 start = text.addr + i * chunk_size;
+      u64 end = std::min(start + chunk_size, text.addr + text.size);
+      JumpTable table;
+      for (u64 addr = start; addr + 4 <= end; addr += 4) {
+        u32 insn;
+        memcpy(&insn, &view.image[addr], sizeof(insn));
+        if (A64::IsBr(insn) && matcher.Match(addr, &table)) {
+          found[i].push_back(table);
+        }
+      }
+    });
+    auto tables = std::make_shared<JumpTables>();
+    for (auto& chunk : found) {
+      for (auto& table : chunk) {
+        tables->push_back(std::move(table));
+      }
+    }
+    auto index = FormatIndex(*tables);
+    result->artifacts.push_back(
+        {".jumptables.json", std::vector<u8>(index.begin(), index.end())});
+    result->data = tables;
+    return true;
+  }
+};
+
+// Names the recovered tables and their case labels in .symtab. Not run by
+// default since it can add many symbols.
+class JumpTableSymbolsPass : public AnalysisPass {
+ public:
+  const char* Name() const override { return "jump_table_symbols"; }
+  std::vector<std::string> Dependencies() const override {
+    return {"jump_tables"};
+  }
+  bool DefaultEnabled() const override { return false; }
+  bool Run(const PassContext& ctx, PassResult* result) override {
+    auto dep = ctx.Find("jump_tables");
+    if (!dep) {
+      return false;
+    }
+    auto& tables = *std::static_pointer_cast<const JumpTables>(dep->data);
+    std::vector<u64> cases;
+    char name[64];
+    for (auto& table : tables) {
+      snprintf(name, sizeof(name), "jumptable_%" PRIx64, table.table);
+      result->symbols.push_back(
+          {name, table.table, table.targets.size() * table.entry_size,
+           STT_OBJECT, STB_LOCAL});
+      cases.insert(cases.end(), table.targets.begin(), table.targets.end());
+    }
+    std::sort(cases.begin(), cases.end());
+    cases.erase(std::unique(cases.begin(), cases.end()), cases.end());
+    for (auto target : cases) {
+      snprintf(name, sizeof(name), "case_%" PRIx64, target);
+      result->symbols.push_back({name, target, 0, STT_NOTYPE, STB_LOCAL});
+    }
+    return true;
+  }
+};
+
+REGISTER_ANALYSIS_PASS(JumpTablePass);
+REGISTER_ANALYSIS_PASS(JumpTableSymbolsPass);
+
+}  // namespace
@@ -0,0 +1,195 @@
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "analysis.h"
+#include "elf_eh.h"
+#include "parallel.h"
+#include "types.h"
+
+namespace {
+
+struct CallSite {
+  u64 start;
+  u64 end;
+  // 0 if there is no landing pad
+  u64 landing_pad;
+  // 1-based offset into the action table, 0 for cleanup only
+  u64 action;
+};
+
+struct Lsda {
+  const EhFde* fde;
+  u64 addr;
+  u64 size;
+  std::vector<CallSite> call_sites;
+};
+
+// Decodes the GCC LSDA at lsda->addr (see the gcc_except_table layout in
+// libgcc's unwind-c.c / libsupc++'s eh_personality.cc). Its size covers the
+// call-site table plus every action record and type table entry reached from
+// it.
+bool ParseLsda(const ImageView& view, Lsda* lsda) {
+  int seg = view.SegmentOf(lsda->addr);
+  if (seg == ImageView::kNumSegment) {
+    return false;
+  }
+  u64 seg_end = view.segments[seg].addr + view.segments[seg].size;
+  u64 func = lsda->fde->pc_begin;
+  EhReader r(view, lsda->addr, seg_end);
+  u8 lpstart_enc = r.Raw<u8>();
+  u64 lpstart =
+      lpstart_enc == DW_EH_PE_omit ? func : r.Pointer(lpstart_enc, 0, func);
+  u8 ttype_enc = r.Raw<u8>();
+  u64 ttype_base = 0;
+  if (ttype_enc != DW_EH_PE_omit) {
+    u64 offset = r.Uleb();
+    ttype_base = r.pos + offset;
+  }
+  u8 call_site_enc = r.Raw<u8>();
+  u64 table_len = r.Uleb();
+  u64 table_end = r.pos + table_len;
+  if (!r.ok || table_end > seg_end) {
+    return false;
+  }
+  while (r.ok && r.pos < table_end) {
+    u64 start = r.Value(call_site_enc);
+    u64 len = r.Value(call_site_enc);
+    u64 landing_pad = r.Value(call_site_enc);
+    u64 action = r.Uleb();
+    lsda->call_sites.push_back({lpstart + start, lpstart + start + len,
+                                landing_pad ? lpstart + landing_pad : 0,
+                                action});
+  }
+  if (!r.ok || r.pos != table_end) {
+    return false;
+  }
+
+  // Action records are (filter, next) sleb128 pairs following the table.
+  u64 end = table_end;
+  for (auto& call_site : lsda->call_sites) {
+    u64 record = call_site.action ? table_end + call_site.action - 1 : 0;
+    // Chains are short; the limit only guards against loops
+    for (int i = 0; record && i < 256; i++) {
+      EhReader a(view, record, seg_end);
+      s64 filter = a.Sleb();
+      u64 next_field = a.pos;
+      s64 next = a.Sleb();
+      if (!a.ok) {
+        return false;
+      }
+      end = std::max(end, a.pos);
+      if (filter < 0 && ttype_base) {
+        // Exception specification: uleb128 type indices ending in 0
+        EhReader spec(view, ttype_base + static_cast<u64>(-(filter + 1)),
+                      seg_end);
+        while (spec.ok && spec.Uleb()) {
+        }
+        end = std::max(end, spec.pos);
+      }
+      record = next ? next_field + next : 0;
+    }
+  }
+  // The type table ends at ttype_base and is indexed backwards from there
+  end = std::max(end, ttype_base);
+  lsda->size = end - lsda->addr;
+  return true;
+}
+
+std::string FormatIndex(const std::vector<Lsda>& lsdas, u64 addr, u64 size) {
+  std::string out;
+  char buf[256];
+  snprintf(buf, sizeof(buf),
+           "{\"gcc_except_table\":{\"addr\":%" PRIu64 ",\"size\":%" PRIu64
+           "},\"functions\":[",
+           addr, size);
+  out += buf;
+  for (size_t i = 0; i < lsdas.size(); i++) {
+    auto& lsda = lsdas[i];
+    snprintf(buf, sizeof(buf),
+             "%s\n{\"start\":%" PRIu64 ",\"end\":%" PRIu64 ",\"fde\":%" PRIu64
+             ",\"lsda\":%" PRIu64 ",\"lsda_size\":%" PRIu64
+             ",\"call_sites\":[",
+             i ? "," : "", lsda.fde->pc_begin, lsda.fde->pc_end,
+             lsda.fde->addr, lsda.addr, lsda.size);
+    out += buf;
+    for (size_t j = 0; j < lsda.call_sites.size(); j++) {
+      auto& call_site = lsda.call_sites[j];
+      snprintf(buf, sizeof(buf),
+               "%s{\"start\":%" PRIu64 ",\"end\":%" PRIu64
+               ",\"landing_pad\":%" PRIu64 ",\"action\":%" PRIu64 "}",
+               j ? "," : "", call_site.start, call_site.end,
+               call_site.landing_pad, call_site.action);
+      out += buf;
+    }
+    out += "]}";
+  }
+  out += "\n]}\n";
+  return out;
+}
+
+// Finds the LSDAs referenced from .eh_frame, emits the range they occupy as
+// .gcc_except_table and writes an index of call sites and landing pads.
+class LsdaPass : public AnalysisPass {
+ public:
+  const char* Name() const override { return "lsda"; }
+  std::vector<std::string> Dependencies() const override {
+    return {"eh_frame"};
+  }
+  bool Run(const PassContext& ctx, PassResult* result) override {
+    auto& view = ctx.view;
+    auto eh_frame = ctx.Find("eh_frame");
+    if (!eh_frame) {
+      return false;
+    }
+    auto& fdes = *std::static_pointer_cast<const EhFdes>(eh_frame->data);
+    std::vector<Lsda> lsdas;
+    for (auto& fde : fdes) {
+      if (fde.lsda) {
+        lsdas.push_back({&fde, fde.lsda, 0, {}});
+      }
+    }
+    std::vector<u8> parsed(lsdas.size());
+    ParallelFor(lsdas.size(), ctx.jobs,
+                [&](size_t i) { parsed[i] = ParseLsda(view, &lsdas[i]); });
+    size_t valid = 0;
+    for (size_t i = 0; i < lsdas.size(); i++) {
+      if (parsed[i] && valid++ != i) {
+        lsdas[valid - 1] = std::move(lsdas[i]);
+      }
+    }
+    lsdas.resize(valid);
+    if (lsdas.empty()) {
+      return true;
+    }
+    std::sort(lsdas.begin(), lsdas.end(), [](const Lsda& a, const Lsda& b) {
+      return a.fde->pc_begin < b.fde->pc_begin;
+    });
+
+    // The linker places all LSDAs together in .rodata
+    u64 start = ~0ull, end = 0;
+    for (auto& lsda : lsdas) {
+      if (view.SegmentOf(lsda.addr) == ImageView::kRodata) {
+        start = std::min(start, lsda.addr);
+        end = std::max(end, lsda.addr + lsda.size);
+      }
+    }
+    if (start < end) {
+      auto& rodata = view.segments[ImageView::kRodata];
+      end = std::min(ALIGN_UP(end, 4), rodata.addr + rodata.size);
+      result->sections.push_back({".gcc_except_table", SHT_PROGBITS,
+                                  SHF_ALLOC, start, end - start, 4, 0, {}});
+    } else {
+      start = end = 0;
+    }
+    auto index = FormatIndex(lsdas, start, end - start);
+    result->artifacts.push_back(
+        {".lsda.json", std::vector<u8>(index.begin(), index.end())});
+    return true;
+  }
+};
+
+REGISTER_ANALYSIS_PASS(LsdaPass);
+
+}  // namespace
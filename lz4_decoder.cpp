@@ -0,0 +1,324 @@
+#include "lz4_decoder.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <iterator>
+
+#include "lz4.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#endif
+
+namespace {
+
+int BundledDecompress(const u8* src, u32 src_len, u8* dst, u32 dst_len) {
+  if (src_len > INT_MAX || dst_len > INT_MAX) {
+    return -1;
+  }
+  return LZ4_decompress_safe(reinterpret_cast<const char*>(src),
+                             reinterpret_cast<char*>(dst), src_len, dst_len);
+}
+
+typedef int (*Lz4DecompressSafeFn)(const char*, char*, int, int);
+
+Lz4DecompressSafeFn LoadSystemLz4() {
+#if defined(NX2ELF_STATIC)
+  return nullptr;
+#elif defined(_WIN32)
+  auto handle = LoadLibraryA("liblz4.dll");
+  return handle ? reinterpret_cast<Lz4DecompressSafeFn>(
+                      GetProcAddress(handle, "LZ4_decompress_safe"))
+                : nullptr;
+#else
+#ifdef __APPLE__
+  const char* name = "liblz4.1.dylib";
+#else
+  const char* name = "liblz4.so.1";
+#endif
+  auto handle = dlopen(name, RTLD_NOW | RTLD_LOCAL);
+  return handle ? reinterpret_cast<Lz4DecompressSafeFn>(
+                      dlsym(handle, "LZ4_decompress_safe"))
+                : nullptr;
+#endif
+}
+
+Lz4DecompressSafeFn system_decompress;
+
+int SystemDecompress(const u8* src, u32 src_len, u8* dst, u32 dst_len) {
+  if (src_len > INT_MAX || dst_len > INT_MAX) {
+    return -1;
+  }
+  return system_decompress(reinterpret_cast<const char*>(src),
+                           reinterpret_cast<char*>(dst), src_len, dst_len);
+}
+
+// Adds an extended length (a run of 255 bytes ended by a smaller one).
+inline bool ReadLength(const u8*& ip, const u8* iend, u64* len) {
+  u8 b;
+  do {
+    if (ip >= iend) {
+      return false;
+    }
+    b = *ip++;
+    *len += b;
+  } while (b == 255);
+  return true;
+}
+
+// Copies |len| bytes in 16 byte blocks. May write up to 15 bytes past
+// dst + len and read as far past src + len.
+inline void WideCopy(u8* dst, const u8* src, u64 len) {
+  for (u64 i = 0; i < len; i += 16) {
+    memcpy(dst + i, src + i, 16);
+  }
+}
+
+// Single pass decoder for whole segments. While input and output are both
+// more than 32 bytes from their end, a sequence with short lengths is copied
+// with fixed size moves and one bounds check; overshoot is overwritten by
+// later sequences. Everything else takes the checked path.
+int FastDecompress(const u8* src, u32 src_len, u8* dst, u32 dst_len) {
+  if (src_len > INT_MAX || dst_len > INT_MAX) {
+    return -1;
+  }
+  const u8* ip = src;
+  const u8* iend = src + src_len;
+  u8* op = dst;
+  u8* oend = dst + dst_len;
+  const u8* ilimit = src_len > 32 ? iend - 32 : src;
+  u8* olimit = dst_len > 32 ? oend - 32 : dst;
+  for (;;) {
+    // Common case: both lengths fit the token and the match doesn't overlap
+    // its own 8 byte moves. Reads at most 17 input bytes and writes 32.
+    if (ip < ilimit && op < olimit) {
+      u8 token = *ip;
+      u64 literals = token >> 4;
+      u64 match = token & 15;
+      u64 offset = ip[1 + literals] | ip[2 + literals] << 8;
+      u8* lit_end = op + literals;
+      if (literals != 15 && offset >= 8 &&
+          offset <= static_cast<u64>(lit_end - dst)) {
+        const u8* from = lit_end - offset;
+        if (match != 15) {
+          memcpy(op, ip + 1, 16);
+          memcpy(lit_end, from, 8);
+          memcpy(lit_end + 8, from + 8, 8);
+          memcpy(lit_end + 16, from + 16, 2);
+          ip += 3 + literals;
+          op = lit_end + match + 4;
+          continue;
+        }
+        // Long match: still no overlap with 16 byte moves
+        const u8* len_ip = ip + 3 + literals;
+        if (offset >= 16 && ReadLength(len_ip, iend, &match) &&
+            match + 4 + 16 <= static_cast<u64>(oend - lit_end)) {
+          memcpy(op, ip + 1, 16);
+          WideCopy(lit_end, from, match + 4);
+          ip = len_ip;
+          op = lit_end + match + 4;
+          continue;
+        }
+      }
+    }
+    if (ip >= iend) {
+      return -1;
+    }
+    u8 token = *ip++;
+    u64 literals = token >> 4;
+    if (literals != 15 && ip < ilimit && op < olimit) {
+      memcpy(op, ip, 16);
+      ip += literals;
+      op += literals;
+    } else {
+      if (literals == 15 && !ReadLength(ip, iend, &literals)) {
+        return -1;
+      }
+      u64 in_room = iend - ip;
+      u64 out_room = oend - op;
+      if (literals > in_room || literals > out_room) {
+        return -1;
+      }
+      if (literals + 16 <= in_room && literals + 16 <= out_room) {
+        WideCopy(op, ip, literals);
+      } else {
+        memcpy(op, ip, literals);
+      }
+      ip += literals;
+      op += literals;
+      // The last sequence only has literals
+      if (ip == iend) {
+        return static_cast<int>(op - dst);
+      }
+    }
+    if (iend - ip < 2) {
+      return -1;
+    }
+    u64 offset = ip[0] | ip[1] << 8;
+    ip += 2;
+    if (offset == 0 || offset > static_cast<u64>(op - dst)) {
+      return -1;
+    }
+    u64 match = token & 15;
+    const u8* from = op - offset;
+    if (match != 15 && offset >= 8 && op < olimit) {
+      // At most 18 bytes
+      memcpy(op, from, 8);
+      memcpy(op + 8, from + 8, 8);
+      memcpy(op + 16, from + 16, 2);
+      op += match + 4;
+      continue;
+    }
+    if (match == 15 && !ReadLength(ip, iend, &match)) {
+      return -1;
+    }
+    match += 4;
+    if (match > static_cast<u64>(oend - op)) {
+      return -1;
+    }
+    u8* end = op + match;
+    // Wide moves overshoot by up to 15 bytes; finish the last ones singly
+    u64 out_room = oend - op;
+    u64 wide = std::min(match, out_room >= 32 ? out_room - 16 : 0);
+    if (wide && offset >= 16) {
+      WideCopy(op, from, wide);
+    } else if (wide) {
+      // Expand the pattern to 16 bytes, then copy from a whole number of
+      // periods (>= 16 bytes) back so the 16 byte moves never overlap.
+      for (int i = 0; i < 16; i++) {
+        op[i] = from[i];
+      }
+      u64 period = offset * ((16 + offset - 1) / offset);
+      for (u8* p = op + 16; p < op + wide; p += 16) {
+        memcpy(p, p - period, 16);
+      }
+    }
+    for (u8* p = op + wide; p < end; p++) {
+      *p = p[-offset];
+    }
+    op = end;
+  }
+}
+
+const Lz4Decoder builtin_decoders[] = {
+    {"bundled", "lz4.c LZ4_decompress_safe", BundledDecompress},
+    {"fast", "single pass with wide copies", FastDecompress},
+};
+
+std::vector<Lz4Decoder> MakeDecoders() {
+  std::vector<Lz4Decoder> decoders(std::begin(builtin_decoders),
+                                   std::end(builtin_decoders));
+  system_decompress = LoadSystemLz4();
+  if (system_decompress) {
+    decoders.push_back(
+        {"system", "LZ4_decompress_safe from liblz4", SystemDecompress});
+  }
+  return decoders;
+}
+
+// Synthetic stand-in for a .text segment: short runs of words copied from
+// recent output mixed with fresh words, so both literals and matches show up
+// about as often as in real code.
+std::vector<u8> MakeCalibrationData() {
+  std::vector<u32> words(16 << 10);
+  u32 seed = 1;
+  auto next = [&seed]() {
+    seed = seed * 1103515245 + 12345;
+    return seed >> 8;
+  };
+  for (size_t i = 0; i < words.size();) {
+    u32 r = next();
+    if (i < 64 || r % 3 == 0) {
+      words[i++] = 0x91000000 | (next() & 0xfffff);
+    } else {
+      size_t from = i - 1 - next() % std::min<size_t>(i, 1024);
+      for (u32 n = 2 + r % 6; n && i < words.size(); n--) {
+        words[i++] = words[from++];
+      }
+    }
+  }
+  auto p = reinterpret_cast<const u8*>(words.data());
+  return std::vector<u8>(p, p + words.size() * sizeof(u32));
+}
+
+// Picks the decoder which is fastest on this CPU. Takes well under a
+// millisecond, and only runs when a compressed segment is first loaded.
+const Lz4Decoder* Calibrate(const std::vector<Lz4Decoder>& decoders) {
+  auto plain = MakeCalibrationData();
+  int size = static_cast<int>(plain.size());
+  std::vector<u8> compressed(LZ4_compressBound(size));
+  int compressed_size = LZ4_compress_default(
+      reinterpret_cast<const char*>(plain.data()),
+      reinterpret_cast<char*>(compressed.data()), size,
+      static_cast<int>(compressed.size()));
+  std::vector<u8> output(size);
+  const Lz4Decoder* best = &decoders[0];
+  double best_seconds = 0;
+  for (auto& decoder : decoders) {
+    // Best of a few runs; the first one also warms up caches
+    double seconds = 0;
+    for (int run = 0; run < 4; run++) {
+      auto start = std::chrono::steady_clock::now();
+      int len = decoder.decompress(compressed.data(), compressed_size,
+                                   output.data(), size);
+      double elapsed = std::chrono::duration<double>(
+                           std::chrono::steady_clock::now() - start)
+                           .count();
+      if (len != size) {
+        seconds = 0;
+        break;
+      }
+      seconds = run ? std::min(seconds, elapsed) : elapsed;
+    }
+    if (seconds > 0 && output == plain &&
+        (best_seconds == 0 || seconds < best_seconds)) {
+      best = &decoder;
+      best_seconds = seconds;
+    }
+  }
+  return best;
+}
+
+std::atomic<const Lz4Decoder*> selected;
+
+}  // namespace
+
+const std::vector<Lz4Decoder>& Lz4Decoders() {
+  static const std::vector<Lz4Decoder> decoders = MakeDecoders();
+  return decoders;
+}
+
+bool SelectLz4Decoder(const char* name) {
+  // Built-in decoders are selected without loading liblz4
+  for (auto& decoder : builtin_decoders) {
+    if (!strcmp(decoder.name, name)) {
+      selected = &decoder;
+      return true;
+    }
+  }
+  auto& decoders = Lz4Decoders();
+  if (!strcmp(name, "auto")) {
+    static const Lz4Decoder* fastest = Calibrate(decoders);
+    selected = fastest;
+    return true;
+  }
+  for (auto& decoder : decoders) {
+    if (!strcmp(decoder.name, name)) {
+      selected = &decoder;
+      return true;
+    }
+  }
+  return false;
+}
+
+const Lz4Decoder& GetLz4Decoder() {
+  if (!selected) {
+    SelectLz4Decoder("auto");
+  }
+  return *selected.load();
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <vector>
+
+#include "types.h"
+
+// An LZ4 block decoder. decompress returns the number of bytes written to dst,
+// or a negative value for malformed input; it never reads or writes outside
+// the buffers.
+struct Lz4Decoder {
+  const char* name;
+  const char* description;
+  int (*decompress)(const u8* src, u32 src_len, u8* dst, u32 dst_len);
+};
+
+// Decoders usable in this process. The system liblz4 is only listed when it
+// can be loaded at runtime.
+const std::vector<Lz4Decoder>& Lz4Decoders();
+
+// Selects the decoder used by NsoFile. "auto" times each decoder on a small
+// synthetic block and picks the fastest on this CPU. Returns false if |name|
+// is unknown or unavailable.
+bool SelectLz4Decoder(const char* name);
+
+// The selected decoder; "auto" if none was selected yet.
+const Lz4Decoder& GetLz4Decoder();
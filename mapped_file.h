@@ -0,0 +1,84 @@
+#pragma once
+
+#include <filesystem>
+
+#include "types.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Read-only mapping of a whole file, for indexes which are queried in place.
+class MappedFile {
+ public:
+  MappedFile() = default;
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+  ~MappedFile() { Close(); }
+
+  bool Open(const std::filesystem::path& path) {
+    Close();
+#ifdef _WIN32
+    HANDLE file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ,
+                              nullptr, OPEN_EXISTING, 0, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+      return false;
+    }
+    LARGE_INTEGER file_size;
+    if (GetFileSizeEx(file, &file_size) && file_size.QuadPart) {
+      mapping_ = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0,
+                                    nullptr);
+      if (mapping_) {
+        data_ = static_cast<const u8*>(
+            MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+        size_ = static_cast<size_t>(file_size.QuadPart);
+      }
+    }
+    CloseHandle(file);
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat st;
+    if (!fstat(fd, &st) && st.st_size > 0) {
+      void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      if (p != MAP_FAILED) {
+        data_ = static_cast<const u8*>(p);
+        size_ = st.st_size;
+      }
+    }
+    close(fd);
+#endif
+    return data_ != nullptr;
+  }
+  void Close() {
+    if (!data_) {
+      return;
+    }
+#ifdef _WIN32
+    UnmapViewOfFile(data_);
+    CloseHandle(mapping_);
+    mapping_ = nullptr;
+#else
+    munmap(const_cast<u8*>(data_), size_);
+#endif
+    data_ = nullptr;
+    size_ = 0;
+  }
+
+  const u8* data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  const u8* data_{};
+  size_t size_{};
+#ifdef _WIN32
+  HANDLE mapping_{};
+#endif
+};
@@ -0,0 +1,305 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <cstring>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "analysis.h"
+#include "lz4.h"
+#include "lz4_decoder.h"
+#include "nso.h"
+#include "types.h"
+#include "xxhash64.h"
+
+// LRU cache of loaded modules for long running processes. Entries are keyed
+// by the content of the input file: its module id (the build id in an NSO or
+// NRO header) and an XXH64 of its bytes. A module patched without a new
+// build id is a different entry, and a copy of the same file under another
+// path is the same one. The image is kept LZ4 compressed next to the loaded
+// state and the results of the analysis passes.
+//
+// Paths are remembered with their size and mtime and the key their content
+// had, so a repeated unchanged path costs a stat; any other path is read and
+// hashed, and the bytes are handed back for loading on a miss. Remembered
+// paths count toward the budget and go with the entry they lead to.
+class ModuleCache {
+ public:
+  // Module id, then the XXH64 of the file. All zero if unknown.
+  typedef std::array<u8, 40> Key;
+
+  // What Restore learned about an input, for Insert
+  struct Probe {
+    Key key;
+    // Of the path, taken before it was read
+    std::uintmax_t size;
+    fs::file_time_type mtime;
+  };
+
+  struct Stats {
+    u64 hits;
+    u64 misses;
+    u64 entries;
+    u64 bytes;
+  };
+
+  explicit ModuleCache(u64 budget) : budget_(budget) {}
+
+  // Restores the module at |path| if cached. |analyzed| is set if |passes|
+  // hold the results of a pass run. |probe| is to be passed to Insert. On a
+  // miss, |file| receives the bytes of |path| if they were read, so they need
+  // not be read again.
+  bool Restore(const fs::path& path,
+               Probe* probe,
+               std::vector<u8>* file,
+               NsoFile* nso,
+               PassResults* passes,
+               bool* analyzed) {
+    bool probed = ProbeKey(path, probe, file);
+    std::shared_ptr<const Entry> entry;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it =
+          probed ? entries_.find(KeyString(probe->key)) : entries_.end();
+      if (it != entries_.end()) {
+        lru_.splice(lru_.begin(), lru_, it->second);
+        entry = *it->second;
+        RememberPath(path.string(), *probe);
+        Trim();
+      }
+      (entry ? stats_.hits : stats_.misses)++;
+    }
+    if (!entry) {
+      return false;
+    }
+    std::vector<u8> image(entry->image_size);
+    if (GetLz4Decoder().decompress(entry->compressed.data(),
+                                   static_cast<u32>(entry->compressed.size()),
+                                   image.data(), entry->image_size) !=
+        static_cast<int>(entry->image_size)) {
+      fprintf(stderr, "module cache: corrupt entry for %s\n",
+              path.string().c_str());
+      return false;
+    }
+    *nso = entry->module;
+    nso->image = std::move(image);
+    auto at = [nso](u64 offset) {
+      return offset == kNone ? nullptr : &nso->image[offset];
+    };
+    nso->dynamic = reinterpret_cast<const Elf64_Dyn*>(at(entry->dynamic));
+    nso->note = reinterpret_cast<const Elf64_Nhdr*>(at(entry->note));
+    *passes = entry->passes;
+    *analyzed = entry->analyzed;
+    return true;
+  }
+
+  // Takes over a module loaded from |path| and the results of its passes.
+  // |probe| is what Restore returned for |path|.
+  void Insert(const fs::path& path,
+              const Probe& probe,
+              NsoFile nso,
+              PassResults passes,
+              bool analyzed) {
+    auto& image = nso.image;
+    if (probe.key == Key{} || image.size() > LZ4_MAX_INPUT_SIZE) {
+      return;
+    }
+    auto entry = std::make_shared<Entry>();
+    entry->key = probe.key;
+    auto offset = [&image](const void* ptr) {
+      return ptr ? static_cast<const u8*>(ptr) - image.data() : kNone;
+    };
+    entry->dynamic = offset(nso.dynamic);
+    entry->note = offset(nso.note);
+    entry->image_size = static_cast<u32>(image.size());
+    int bound = LZ4_compressBound(static_cast<int>(image.size()));
+    entry->compressed.resize(bound);
+    int size = LZ4_compress_default(
+        reinterpret_cast<const char*>(image.data()),
+        reinterpret_cast<char*>(entry->compressed.data()),
+        static_cast<int>(image.size()), bound);
+    if (size <= 0) {
+      return;
+    }
+    entry->compressed.resize(size);
+    entry->compressed.shrink_to_fit();
+    std::vector<u8>().swap(image);
+    nso.dynamic = nullptr;
+    nso.note = nullptr;
+    nso.symbols_by_addr.clear();
+    entry->module = std::move(nso);
+    entry->cost = sizeof(Entry) + entry->compressed.size();
+    // Private pass data only feeds dependent passes, which have run
+    for (auto& result : passes) {
+      result.second.data.reset();
+      for (auto& section : result.second.sections) {
+        entry->cost += sizeof(section) + section.name.size() +
+                       section.data.size();
+      }
+      for (auto& symbol : result.second.symbols) {
+        entry->cost += sizeof(symbol) + symbol.name.size();
+      }
+      for (auto& artifact : result.second.artifacts) {
+        entry->cost += sizeof(artifact) + artifact.data.size();
+      }
+      entry->cost += result.second.dynsym_sizes.size() *
+                     sizeof(result.second.dynsym_sizes[0]);
+    }
+    entry->passes = std::move(passes);
+    entry->analyzed = analyzed;
+    if (entry->cost > budget_) {
+      return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto key_string = KeyString(entry->key);
+    auto it = entries_.find(key_string);
+    if (it != entries_.end()) {
+      Evict(it->second);
+    }
+    stats_.bytes += entry->cost;
+    lru_.push_front(std::move(entry));
+    entries_[key_string] = lru_.begin();
+    RememberPath(path.string(), probe);
+    Trim();
+  }
+
+  Stats GetStats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Stats stats = stats_;
+    stats.entries = lru_.size();
+    return stats;
+  }
+
+ private:
+  static constexpr u64 kNone = ~0ull;
+
+  struct Entry {
+    Key key;
+    // Loaded state without the image
+    NsoFile module;
+    std::vector<u8> compressed;
+    u32 image_size;
+    // Image offsets of NsoFile::dynamic and NsoFile::note, or kNone
+    u64 dynamic;
+    u64 note;
+    PassResults passes;
+    bool analyzed;
+    u64 cost;
+  };
+  typedef std::list<std::shared_ptr<const Entry>> Lru;
+
+  static std::string KeyString(const Key& key) {
+    return std::string(key.begin(), key.end());
+  }
+  // Held in paths_ and in the list of the entry
+  static u64 PathCost(const std::string& path) {
+    return sizeof(Probe) + 2 * (sizeof(path) + path.size());
+  }
+
+  // Finds the key of |path| from a visit with the same size and mtime, or
+  // else by reading it into |file|.
+  bool ProbeKey(const fs::path& path, Probe* probe, std::vector<u8>* file) {
+    *probe = {};
+    std::error_code error;
+    probe->size = fs::file_size(path, error);
+    if (!error) {
+      probe->mtime = fs::last_write_time(path, error);
+    }
+    if (error) {
+      return false;
+    }
+    auto& key = probe->key;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = paths_.find(path.string());
+      if (it != paths_.end() && it->second.size == probe->size &&
+          it->second.mtime == probe->mtime) {
+        key = it->second.key;
+        return true;
+      }
+    }
+    // The stat above predates the read, so a write racing with it changes
+    // the mtime seen on the next visit.
+    *file = File::Read(path);
+    if (file->empty()) {
+      return false;
+    }
+    const size_t nro_offset = ALIGN_UP(sizeof(NsoFile::ModPointer), 0x10);
+    if (file->size() >= sizeof(NsoFile::NsoHeader) &&
+        !memcmp(file->data(), NsoFile::nso_magic.data(),
+                NsoFile::nso_magic.size())) {
+      auto header = reinterpret_cast<const NsoFile::NsoHeader*>(file->data());
+      std::copy(header->gnu_build_id.begin(), header->gnu_build_id.end(),
+                key.begin());
+    } else if (file->size() >= nro_offset + sizeof(NsoFile::NroHeader) &&
+               !memcmp(&(*file)[nro_offset], NsoFile::nro_magic.data(),
+                       NsoFile::nro_magic.size())) {
+      auto header =
+          reinterpret_cast<const NsoFile::NroHeader*>(&(*file)[nro_offset]);
+      std::copy(header->gnu_build_id.begin(), header->gnu_build_id.end(),
+                key.begin());
+    }
+    u64 hash = XXH64::Hash(file->data(), file->size());
+    memcpy(&key[key.size() - sizeof(hash)], &hash, sizeof(hash));
+    return true;
+  }
+
+  // Points |path| at the entry of probe.key, which must exist. Requires
+  // mutex_.
+  void RememberPath(const std::string& path, const Probe& probe) {
+    auto key_string = KeyString(probe.key);
+    auto it = paths_.find(path);
+    if (it != paths_.end()) {
+      if (it->second.key != probe.key) {
+        auto& old_paths = entry_paths_[KeyString(it->second.key)];
+        old_paths.erase(std::find(old_paths.begin(), old_paths.end(), path));
+        entry_paths_[key_string].push_back(path);
+      }
+      it->second = probe;
+      return;
+    }
+    paths_[path] = probe;
+    entry_paths_[key_string].push_back(path);
+    stats_.bytes += PathCost(path);
+  }
+
+  // Requires mutex_
+  void Trim() {
+    while (stats_.bytes > budget_ && !lru_.empty()) {
+      Evict(std::prev(lru_.end()));
+    }
+  }
+
+  // Drops the entry and the paths leading to it. Requires mutex_.
+  void Evict(Lru::iterator it) {
+    auto key_string = KeyString((*it)->key);
+    auto paths = entry_paths_.find(key_string);
+    if (paths != entry_paths_.end()) {
+      for (auto& path : paths->second) {
+        paths_.erase(path);
+        stats_.bytes -= PathCost(path);
+      }
+      entry_paths_.erase(paths);
+    }
+    stats_.bytes -= (*it)->cost;
+    entries_.erase(key_string);
+    lru_.erase(it);
+  }
+
+  const u64 budget_;
+  std::mutex mutex_;
+  // Most recently used first
+  Lru lru_;
+  std::unordered_map<std::string, Lru::iterator> entries_;
+  std::unordered_map<std::string, Probe> paths_;
+  // Paths in paths_ by the key of their entry
+  std::unordered_map<std::string, std::vector<std::string>> entry_paths_;
+  Stats stats_{};
+};
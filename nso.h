@@ -0,0 +1,2061 @@
+#pragma once
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <filesystem>
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "analysis.h"
+#include "blake3.h"
+#include "direct_io.h"
+#include "elf.h"
+#include "elf_eh.h"
+#include "io_limit.h"
+#include "lz4_decoder.h"
+#include "types.h"
+
+namespace fs = std::filesystem;
+
+namespace File {
+
+struct FileDeleter {
+  typedef std::FILE* pointer;
+  void operator()(FILE* f) { std::fclose(f); }
+};
+typedef std::unique_ptr<std::FILE, FileDeleter> UniqueFile;
+
+inline void iter_files(const fs::path& directory,
+                       std::function<void(const fs::path&)> func) {
+  for (auto& dirent : fs::directory_iterator(directory)) {
+    auto& path = dirent.path();
+    if (!fs::is_directory(path)) {
+      func(path);
+    }
+  }
+}
+
+// Set in batch mode to throttle Read and Write.
+inline IoLimiter* io_limiter;
+
+inline UniqueFile Open(const fs::path& path, const char* mode) {
+  return UniqueFile{fopen(path.string().c_str(), mode)};
+}
+
+inline std::vector<u8> Read(const fs::path& path) {
+  std::error_code error;
+  auto size = fs::file_size(path, error);
+  if (size == std::numeric_limits<std::uintmax_t>::max())
+    return {};
+  auto buffer = std::vector<u8>(size);
+  auto f = Open(path, "rb");
+  if (!f)
+    return {};
+  if (!io_limiter) {
+    if (!fread(buffer.data(), buffer.size(), 1, f.get()))
+      return {};
+    return buffer;
+  }
+  if (buffer.empty())
+    return {};
+  for (size_t done = 0; done < buffer.size();) {
+    size_t len = std::min(buffer.size() - done, io_limiter->chunk_size);
+    io_limiter->Acquire(len, false);
+    if (!fread(&buffer[done], len, 1, f.get()))
+      return {};
+    done += len;
+  }
+  return buffer;
+}
+
+// Reads |size| bytes at |offset| of |f|.
+inline bool ReadAt(FILE* f, u64 offset, u8* out, size_t size) {
+  if (fseek(f, static_cast<long>(offset), SEEK_SET))
+    return false;
+  if (!io_limiter)
+    return !size || fread(out, size, 1, f);
+  for (size_t done = 0; done < size;) {
+    size_t len = std::min(size - done, io_limiter->chunk_size);
+    io_limiter->Acquire(len, false);
+    if (!fread(&out[done], len, 1, f))
+      return false;
+    done += len;
+  }
+  return true;
+}
+
+inline bool Write(const fs::path& path, const std::vector<u8>& buffer) {
+#ifdef __linux__
+  if (direct_write_min && buffer.size() >= direct_write_min)
+    return WriteDirect(path, buffer.data(), buffer.size(), io_limiter);
+#endif
+  auto f = Open(path, "wb");
+  if (!f)
+    return false;
+  if (!io_limiter)
+    return !!fwrite(buffer.data(), buffer.size(), 1, f.get());
+  for (size_t done = 0; done < buffer.size();) {
+    size_t len = std::min(buffer.size() - done, io_limiter->chunk_size);
+    io_limiter->Acquire(len, true);
+    if (!fwrite(&buffer[done], len, 1, f.get()))
+      return false;
+    done += len;
+  }
+  return true;
+}
+
+};  // namespace File
+
+struct StringTable {
+  StringTable() { AddString(""); }
+  void AddString(const char* str) {
+    if (!entries.count(str)) {
+      entries[str] = watermark;
+      watermark += static_cast<u32>(strlen(str)) + sizeof(*str);
+    }
+  }
+  u32 GetOffset(const char* str) {
+    if (!entries.count(str)) {
+      return 0;
+    }
+    return entries[str];
+  }
+  std::vector<char> GetBuffer() {
+    std::vector<char> buffer(watermark);
+    for (const auto& entry : entries) {
+      strcpy(&buffer[entry.second], entry.first);
+    }
+    return buffer;
+  }
+  void Finalize() {
+    buffer = GetBuffer();
+    size = ALIGN_UP(buffer.size(), 0x10);
+  }
+  std::unordered_map<const char*, u32> entries;
+  u32 watermark{};
+  u64 offset;
+  u64 size;
+  std::vector<char> buffer;
+};
+
+struct NsoFile {
+  enum FileType {
+    kUnknown,
+    kNso,
+    kNro,
+    kMod,
+    kElf,
+  };
+  enum SegmentType { kText, kRodata, kData, kNumSegment };
+  static const std::array<u8, 4> nso_magic;
+  static const std::array<u8, 4> nro_magic;
+  static const std::array<u8, 4> mod_magic;
+  static const std::array<const char*, kNumSegment> segment_names;
+  struct SegmentHeader {
+    u32 file_offset;  // maybe &1==compressed?
+    u32 mem_offset;
+    u32 mem_size;
+    u32 bss_align;
+  };
+  struct DataExtent {
+    u32 offset;
+    u32 size;
+  };
+  struct NsoHeader {
+    u8 magic[4];
+    u32 field_4;
+    u32 field_8;
+    u32 flags;
+    SegmentHeader segments[kNumSegment];
+    // value from .note, can be various lengths :/
+    std::array<u8, 32> gnu_build_id;
+    u32 segment_file_sizes[kNumSegment];
+    u32 field_6c[7];
+    // .rodata-relative, like the tables below
+    DataExtent api_info;
+    DataExtent dynstr;
+    DataExtent dynsym;
+    sha256_digest segment_digests[kNumSegment];
+  };
+  // NRO stores the flat memory image - nothing needs to be decompressed or
+  // relocated (although relocation fixups need to be applied). This also
+  // implies that +4 in the file points to MOD header, so NRO header is at
+  // offset 0x10 instead of 0.
+  struct NroHeader {
+    u8 magic[4];
+    u32 field_4;
+    u32 file_size;
+    u32 field_c;
+    DataExtent segments[kNumSegment];
+    u32 bss_size;
+    u32 field_3c;
+    std::array<u8, 32> gnu_build_id;
+    u32 field_60[2];
+    DataExtent api_info;
+    DataExtent dynstr;
+    DataExtent dynsym;
+  };
+  struct ModPointer {
+    u32 field_0;
+    u32 magic_offset;
+  };
+  struct ModHeader {
+    // yaya, there are some fields here...for parsing, easier to ignore.
+    // ModPointer mod_ptr;
+    u8 magic[4];
+    s32 dynamic_offset;
+    s32 bss_start_offset;
+    s32 bss_end_offset;
+    s32 eh_start_offset;
+    s32 eh_end_offset;
+    s32 module_object_offset;
+    // It seems the area around MOD0 is used for .note section
+    // There is also a nss-name section
+  };
+  template <typename T>
+  char* FormatBytes(char* p, T d) {
+    for (auto& b : d)
+      p += sprintf(p, "%02x", b);
+    return p;
+  }
+  void Dump(bool verbose = false) {
+    char msg[1024];
+    char* p = msg;
+    const char* idx2prot[kNumSegment] = {"r-x", "r--", "rw-"};
+
+#define FMT_FIELD(f) p += sprintf(p, #f ": %8x\n", header.f);
+
+		if (verbose) {
+			FMT_FIELD(field_4);
+			FMT_FIELD(field_8);
+			FMT_FIELD(flags);
+		}
+
+    p += sprintf(p, "gnu_build_id: ");
+    p = FormatBytes(p, header.gnu_build_id);
+    p += sprintf(p, "\n");
+    if (has_image_hash) {
+      p += sprintf(p, "image_hash: ");
+      p = FormatBytes(p, image_hash);
+      p += sprintf(p, "\n");
+    }
+
+    p += sprintf(p, "         %-8s %-8s %-8s %-8s %-8s\n", "file off",
+                 "file len", "mem off", "mem len", "bss/algn");
+    for (int i = 0; i < kNumSegment; i++) {
+      auto& seg = header.segments[i];
+      auto& file_size = header.segment_file_sizes[i];
+      p += sprintf(p, "%d [%-3s]: %8x %8x %8x %8x %8x\n", i, idx2prot[i],
+                   seg.file_offset, file_size, seg.mem_offset, seg.mem_size,
+                   seg.bss_align);
+    }
+
+    if (verbose) {
+      for (int i = 0; i < ARRAY_SIZE(header.field_6c); i++)
+        FMT_FIELD(field_6c[i]);
+    }
+
+    p += sprintf(p, ".rodata-relative:\n");
+    p += sprintf(p, "  .dynstr: %8x %8x\n", header.dynstr.offset,
+                 header.dynstr.size);
+    p += sprintf(p, "  .dynsym: %8x %8x\n", header.dynsym.offset,
+                 header.dynsym.size);
+    if (header.api_info.size) {
+      p += sprintf(p, "  .api_info: %6x %8x\n", header.api_info.offset,
+                   header.api_info.size);
+    }
+
+    p += sprintf(p, "segment digests:\n");
+    for (int i = 0; i < kNumSegment; i++) {
+      p += sprintf(p, "%d [%-3s]: ", i, idx2prot[i]);
+      p = FormatBytes(p, header.segment_digests[i]);
+      p += sprintf(p, "\n");
+    }
+
+#undef FMT_FIELD
+
+    printf("%s", msg);
+    auto libraries = ApiInfo();
+    if (!libraries.empty()) {
+      puts("libraries:");
+      for (auto& library : libraries) {
+        printf("  %-8s %-16s %s\n", library.kind.c_str(),
+               library.vendor.c_str(), library.name.c_str());
+      }
+    }
+  }
+  bool Decompress(u8* dst, u32 dst_len, const u8* src, u32 src_len) {
+    auto& decoder = GetLz4Decoder();
+    int len = decoder.decompress(src, src_len, dst, dst_len);
+    if (len != dst_len)
+      printf("%s lz4: %d (expected %8x)\n", decoder.name, len, dst_len);
+    return len > 0;
+  }
+  bool ResolvePlt(void* base, size_t len) {
+    // Each plt slot is 4 instructions. The first entry fills 2 slots (resolving
+    // thunk).
+    if (dyn_info.pltrelsz) {
+      const u32 plt_pattern[]{0xa9bf7bf0, 0xd00004d0, 0xf9428a11, 0x91144210,
+                              0xd61f0220, 0xd503201f, 0xd503201f, 0xd503201f};
+      const u32 plt_mask[ARRAY_SIZE(plt_pattern)]{
+          0xffffffff, 0x00000000, 0xff000000, 0xff000000,
+          0xff000000, 0xffffffff, 0xffffffff, 0xffffffff};
+      auto found = static_cast<u8*>(
+          memmem_m(base, len, plt_pattern, plt_mask, sizeof(plt_pattern)));
+      if (found) {
+        plt_info.addr = found - &image[0];
+        // Assume the plt exactly matches .rela.plt
+        u64 plt_entry_count = dyn_info.pltrelsz / sizeof(Elf64_Rela);
+        const u64 plt_entry_size = sizeof(u32) * 4;
+        plt_info.size = plt_entry_size * 2 + plt_entry_size * plt_entry_count;
+        return true;
+      }
+    }
+    return false;
+  }
+  // |jobs| threads hash the image of a module without a build id, unless
+  // |hash_image| is cleared
+  bool Load(const fs::path& path, unsigned jobs = 1) {
+    auto f = File::Open(path, "rb");
+    if (f && File::ReadAt(f.get(), 0, reinterpret_cast<u8*>(&header),
+                          sizeof(header)) &&
+        !memcmp(header.magic, &nso_magic[0], nso_magic.size())) {
+      return LoadNso(f.get()) && FinishLoad(jobs);
+    }
+    header = {};
+    f.reset();
+    return Load(File::Read(path), jobs);
+  }
+  bool Load(std::vector<u8> file, unsigned jobs = 1) {
+    return LoadImage(std::move(file)) && FinishLoad(jobs);
+  }
+  bool FinishLoad(unsigned jobs) {
+    if (hash_image && !HasBuildId()) {
+      HashImage(jobs);
+    }
+    return true;
+  }
+  bool HasBuildId() const {
+    return std::any_of(header.gnu_build_id.begin(), header.gnu_build_id.end(),
+                       [](u8 b) { return b != 0; });
+  }
+  // Fallback identity: BLAKE3 over the contents of the three segments
+  void HashImage(unsigned jobs) {
+    std::vector<BLAKE3::Range> ranges;
+    for (auto& seg : header.segments) {
+      ranges.push_back({&image[seg.mem_offset], seg.mem_size});
+    }
+    image_hash = BLAKE3::HashRanges(ranges, jobs);
+    has_image_hash = true;
+  }
+  bool LoadImage(std::vector<u8> file) {
+    const size_t nro_offset = ALIGN_UP(sizeof(ModPointer), 0x10);
+    if (file.size() >= sizeof(NsoHeader) &&
+        !memcmp(&file[0], &nso_magic[0], nso_magic.size())) {
+      memcpy(&header, &file[0], sizeof(header));
+      if (!AllocateNsoImage(file.size())) {
+        return false;
+      }
+      for (int i = 0; i < kNumSegment; i++) {
+        if (!LoadNsoSegment(i, &file[header.segments[i].file_offset])) {
+          return false;
+        }
+      }
+      file_type = kNso;
+    } else if (file.size() >= nro_offset + sizeof(NroHeader) &&
+               !memcmp(&file[nro_offset], &nro_magic[0], nro_magic.size())) {
+      // Translate the nro header to nso, which is a superset
+      auto nro = reinterpret_cast<NroHeader*>(&file[nro_offset]);
+      if (nro->file_size != file.size()) {
+        return false;
+      }
+      for (int i = 0; i < kNumSegment; i++) {
+        auto& seg = header.segments[i];
+        // TODO revisit once some nso with uncompressed segments is seen
+        seg.mem_offset = seg.file_offset = nro->segments[i].offset;
+        seg.mem_size = header.segment_file_sizes[i] = nro->segments[i].size;
+        switch (i) {
+        case kText:
+          seg.bss_align = 0x100;
+          break;
+        case kRodata:
+          seg.bss_align = 1;
+          break;
+        case kData:
+          seg.bss_align = nro->bss_size;
+          break;
+        }
+      }
+      header.gnu_build_id = nro->gnu_build_id;
+      header.api_info = nro->api_info;
+      header.dynstr = nro->dynstr;
+      header.dynsym = nro->dynsym;
+
+      image = std::move(file);
+      file_type = kNro;
+    } else if (file.size() >= sizeof(Elf64_Ehdr) &&
+               reinterpret_cast<const ElfIdent*>(&file[0])->is_valid()) {
+      return LoadElf(std::move(file));
+    }
+
+    return ParseModule(std::move(file));
+  }
+  // Checks the segments in |header| against the file size and allocates the
+  // image for them.
+  bool AllocateNsoImage(u64 file_size) {
+    for (int i = 0; i < kNumSegment; i++) {
+      auto& seg = header.segments[i];
+      u32 size = header.segment_file_sizes[i];
+      bool compressed = header.flags & (1 << i);
+      if (u64(seg.file_offset) + size > file_size ||
+          (compressed ? !size : size > seg.mem_size)) {
+        fprintf(stderr, "bad segment %d\n", i);
+        return false;
+      }
+    }
+    // .bss is not part of the image; it can be hundreds of MB
+    u64 image_size = 0;
+    for (auto& seg : header.segments) {
+      image_size = std::max(image_size, u64(seg.mem_offset) + seg.mem_size);
+    }
+    image = std::vector<u8>(image_size);
+    return true;
+  }
+  // |data| holds the segment's bytes as stored in the file
+  bool LoadNsoSegment(int i, const u8* data) {
+    auto& seg = header.segments[i];
+    auto file_size = header.segment_file_sizes[i];
+    if (header.flags & (1 << i)) {
+      return Decompress(&image[seg.mem_offset], seg.mem_size, data, file_size);
+    }
+    std::memcpy(&image[seg.mem_offset], data, file_size);
+    return true;
+  }
+  // Reads the segments of the NSO whose header is loaded in file order, and
+  // decompresses each on this thread while the next ones are being read.
+  bool LoadNso(FILE* f) {
+    if (fseek(f, 0, SEEK_END)) {
+      return false;
+    }
+    if (!AllocateNsoImage(static_cast<u64>(ftell(f)))) {
+      return false;
+    }
+    int order[kNumSegment] = {kText, kRodata, kData};
+    std::sort(order, order + kNumSegment, [this](int a, int b) {
+      return header.segments[a].file_offset < header.segments[b].file_offset;
+    });
+    // Not zero filled, as it is read over
+    std::unique_ptr<u8[]> compressed[kNumSegment];
+    std::promise<bool> read[kNumSegment];
+    std::thread reader([&] {
+      for (int i : order) {
+        auto& seg = header.segments[i];
+        auto size = header.segment_file_sizes[i];
+        // Uncompressed segments are read in place
+        u8* out = &image[seg.mem_offset];
+        if (header.flags & (1 << i)) {
+          compressed[i].reset(new u8[size]);
+          out = compressed[i].get();
+        }
+        read[i].set_value(File::ReadAt(f, seg.file_offset, out, size));
+      }
+    });
+    bool success = true;
+    for (int i : order) {
+      if (!read[i].get_future().get() ||
+          ((header.flags & (1 << i)) &&
+           !LoadNsoSegment(i, compressed[i].get()))) {
+        success = false;
+        break;
+      }
+      compressed[i].reset();
+    }
+    reader.join();
+    if (!success) {
+      return false;
+    }
+    file_type = kNso;
+    return ParseModule({});
+  }
+  // Finds MOD0 and everything it describes. |file| is only used if the image
+  // has not been loaded, for a bare MOD image.
+  bool ParseModule(std::vector<u8> file) {
+    u8* mod_base = nullptr;
+    ModPointer* mod_ptr = nullptr;
+    if (file_type != kUnknown) {
+      mod_ptr = reinterpret_cast<ModPointer*>(&image[0]);
+      if (mod_ptr->magic_offset + sizeof(ModHeader) > image.size()) {
+        return false;
+      }
+      mod_base = &image[mod_ptr->magic_offset];
+    } else if (file.size() >= sizeof(ModPointer)) {
+      // It's not an NSO or NRO, but still need to check for MOD
+      mod_ptr = reinterpret_cast<ModPointer*>(&file[0]);
+      if (mod_ptr->magic_offset + sizeof(ModHeader) > file.size()) {
+        return false;
+      }
+      mod_base = &file[mod_ptr->magic_offset];
+    } else {
+      return false;
+    }
+    auto mod = reinterpret_cast<ModHeader*>(mod_base);
+    if (memcmp(mod->magic, &mod_magic[0], mod_magic.size()))
+      return false;
+
+    if (file_type == kUnknown) {
+      // Apparently there are images which are essentially NROs, but lack
+      // the NRO header, for some reason. This is a pain.
+      image = std::move(file);
+      file_type = kMod;
+    }
+    /*
+    fs::path dump(path);
+    File::Write(dump.replace_extension(".bin"), image);
+    //*/
+
+    auto mod_get_offset = [&](s32 relative_offset) {
+      auto ptr = reinterpret_cast<u8*>(mod_base + relative_offset);
+      auto offset = reinterpret_cast<uintptr_t>(ptr) -
+                    reinterpret_cast<uintptr_t>(&image[0]);
+      return static_cast<u32>(offset);
+    };
+
+    dynamic = reinterpret_cast<Elf64_Dyn*>(mod_base + mod->dynamic_offset);
+    ParseDynamic();
+    if (file_type != kMod) {
+      auto& text_seg = header.segments[kText];
+      ResolvePlt(&image[text_seg.mem_offset], text_seg.mem_size);
+    }
+
+    if (file_type == kMod) {
+      // need to manually build them ...
+      DataExtent segments[kNumSegment]{};
+
+      // XXX hacks...
+      if (!ResolvePlt(&image[0], image.size())) {
+        fputs("error: raw MOD requires .plt. please report this.\n", stderr);
+        return false;
+      }
+      if (dyn_info.symtab >= dyn_info.strtab) {
+        fputs(
+            "error: raw MOD requires .dynstr directly after .dynsym. please "
+            "report this.\n",
+            stderr);
+        return false;
+      }
+      // Need this up-front to be able to iter_dynsym
+      header.dynsym.size = static_cast<u32>(dyn_info.strtab - dyn_info.symtab);
+      // yet another dirty hack. relies on all sections having at least
+      // one symbol pointing into them, and a section symbol existing for .data
+      std::vector<u16> seen_shndx;
+      iter_dynsym([&](const Elf64_Sym& sym, u32) {
+        if (sym.st_shndx == SHN_UNDEF || sym.st_shndx >= SHN_LORESERVE) {
+          return;
+        }
+        seen_shndx.push_back(sym.st_shndx);
+      });
+      std::sort(seen_shndx.begin(), seen_shndx.end());
+      seen_shndx.erase(std::unique(seen_shndx.begin(), seen_shndx.end()),
+                       seen_shndx.end());
+      if (seen_shndx.size() != kNumSegment + 1) {
+        fputs(
+            "error: raw MOD failed to find .data in .dynsym. please report "
+            "this.\n",
+            stderr);
+        return false;
+      }
+      iter_dynsym([&](const Elf64_Sym& sym, u32) {
+        if (segments[kData].offset == 0 &&
+            ELF64_ST_TYPE(sym.st_info) == STT_SECTION &&
+            sym.st_shndx == seen_shndx[kData]) {
+          segments[kData].offset = static_cast<u32>(sym.st_value);
+        }
+      });
+      if (segments[kData].offset == 0) {
+        fputs(
+            "error: raw MOD failed to find .data in .dynsym. please report "
+            "this.\n",
+            stderr);
+        return false;
+      }
+
+      segments[kText].offset = 0;
+      segments[kText].size = static_cast<u32>(plt_info.addr + plt_info.size);
+      segments[kRodata].offset =
+          ALIGN_UP(segments[kText].offset + segments[kText].size, 0x1000);
+      segments[kRodata].size =
+          segments[kData].offset - segments[kRodata].offset;
+      segments[kData].size =
+          static_cast<u32>(image.size() - segments[kData].offset);
+
+      header.dynstr.offset =
+          static_cast<u32>(dyn_info.strtab - segments[kRodata].offset);
+      header.dynstr.size = static_cast<u32>(dyn_info.strsz);
+      header.dynsym.offset =
+          static_cast<u32>(dyn_info.symtab - segments[kRodata].offset);
+
+      for (int i = 0; i < kNumSegment; i++) {
+        auto& seg = header.segments[i];
+        seg.mem_offset = seg.file_offset = segments[i].offset;
+        seg.mem_size = header.segment_file_sizes[i] = segments[i].size;
+        switch (i) {
+        case kText:
+          seg.bss_align = 0x100;
+          break;
+        case kRodata:
+          seg.bss_align = 1;
+          break;
+        case kData:
+          // This is the actual size cleared by init code, but there
+          // is a symbol named "end" which will be referenced and is
+          // at the aligned boundary. So pad it out until there.
+          // This is debatably a bug in nintendo's tools.
+          seg.bss_align = mod_get_offset(mod->bss_end_offset) -
+                          mod_get_offset(mod->bss_start_offset);
+          seg.bss_align = ALIGN_UP(seg.bss_align, 0x1000) + 1;
+          break;
+        }
+      }
+    }
+
+    FindBuildIdNote();
+
+    // In case of MOD-only file, we can only fill in build id if the section was
+    // found manually
+    if (file_type == kMod && note) {
+      auto build_id = reinterpret_cast<const GnuBuildId*>(note);
+      memcpy(header.gnu_build_id.data(), build_id->build_id_raw.data(),
+             build_id->header.n_descsz);
+    }
+
+    eh_info.hdr_addr = mod_get_offset(mod->eh_start_offset);
+    eh_info.hdr_size = mod_get_offset(mod->eh_end_offset) - eh_info.hdr_addr;
+
+    return true;
+  }
+  // Rebuilds the module from an AArch64 ELF, such as one written by
+  // WriteElf: segments from PT_LOAD by permission, .dynamic from PT_DYNAMIC,
+  // the build id from PT_NOTE and EH info from PT_GNU_EH_FRAME.
+  bool LoadElf(std::vector<u8> file) {
+    Elf64_Ehdr ehdr;
+    memcpy(&ehdr, &file[0], sizeof(ehdr));
+    if (!ehdr.e_ident.is_64() || ehdr.e_ident.is_msb() ||
+        ehdr.e_machine != EM_AARCH64 ||
+        ehdr.e_phentsize != sizeof(Elf64_Phdr) ||
+        ehdr.e_phoff > file.size() ||
+        ehdr.e_phnum > (file.size() - ehdr.e_phoff) / sizeof(Elf64_Phdr)) {
+      fputs("error: not a little endian AArch64 ELF64\n", stderr);
+      return false;
+    }
+    std::vector<Elf64_Phdr> phdrs(ehdr.e_phnum);
+    if (!phdrs.empty()) {
+      memcpy(phdrs.data(), &file[ehdr.e_phoff],
+             phdrs.size() * sizeof(Elf64_Phdr));
+    }
+
+    struct {
+      u64 start{~0ull};
+      u64 file_end{};
+      u64 mem_end{};
+      u64 align{1};
+    } extents[kNumSegment];
+    u64 image_size = 0;
+    for (auto& phdr : phdrs) {
+      if (phdr.p_type != PT_LOAD) {
+        continue;
+      }
+      // Offsets in the NSO model are 32 bits
+      if (phdr.p_filesz > phdr.p_memsz || phdr.p_offset > file.size() ||
+          phdr.p_filesz > file.size() - phdr.p_offset ||
+          phdr.p_vaddr > UINT32_MAX ||
+          phdr.p_memsz > UINT32_MAX - phdr.p_vaddr) {
+        fputs("error: ELF PT_LOAD out of range\n", stderr);
+        return false;
+      }
+      int i = (phdr.p_flags & PF_X)   ? kText
+              : (phdr.p_flags & PF_W) ? kData
+                                      : kRodata;
+      auto& extent = extents[i];
+      if (phdr.p_vaddr < extent.start) {
+        extent.align = std::max<u64>(phdr.p_align, 1);
+      }
+      extent.start = std::min(extent.start, phdr.p_vaddr);
+      extent.file_end =
+          std::max(extent.file_end, phdr.p_vaddr + phdr.p_filesz);
+      extent.mem_end = std::max(extent.mem_end, phdr.p_vaddr + phdr.p_memsz);
+    }
+    for (int i = 0; i < kNumSegment; i++) {
+      auto& extent = extents[i];
+      if (extent.start == ~0ull) {
+        fputs("error: ELF needs r-x, r-- and rw- PT_LOADs\n", stderr);
+        return false;
+      }
+      // The image ends with the file backed part of .data, like for NSOs
+      image_size =
+          std::max(image_size, i == kData ? extent.file_end : extent.mem_end);
+    }
+    image = std::vector<u8>(image_size);
+    for (auto& phdr : phdrs) {
+      if (phdr.p_type == PT_LOAD && phdr.p_filesz) {
+        memcpy(&image[phdr.p_vaddr], &file[phdr.p_offset], phdr.p_filesz);
+      }
+    }
+    for (int i = 0; i < kNumSegment; i++) {
+      auto& seg = header.segments[i];
+      auto& extent = extents[i];
+      u64 end = i == kData ? extent.file_end : extent.mem_end;
+      seg.mem_offset = seg.file_offset = static_cast<u32>(extent.start);
+      seg.mem_size = header.segment_file_sizes[i] =
+          static_cast<u32>(std::max(end, extent.start) - extent.start);
+      // Like NSO headers, the field is the alignment except for .data
+      seg.bss_align =
+          i == kData
+              ? static_cast<u32>(extent.mem_end - extent.start - seg.mem_size)
+              : static_cast<u32>(std::min<u64>(extent.align, 0x1000));
+    }
+
+    auto contains = [this](u64 addr, u64 size) {
+      return addr <= image.size() && size <= image.size() - addr;
+    };
+    for (auto& phdr : phdrs) {
+      if (phdr.p_type == PT_DYNAMIC && contains(phdr.p_vaddr, phdr.p_memsz)) {
+        // Must be terminated within the image
+        auto dyn = reinterpret_cast<const Elf64_Dyn*>(&image[phdr.p_vaddr]);
+        size_t count = (image.size() - phdr.p_vaddr) / sizeof(Elf64_Dyn);
+        for (size_t i = 0; i < count; i++) {
+          if (dyn[i].d_tag == DT_NULL) {
+            dynamic = dyn;
+            break;
+          }
+        }
+      } else if (phdr.p_type == PT_GNU_EH_FRAME &&
+                 contains(phdr.p_vaddr, phdr.p_memsz)) {
+        eh_info.hdr_addr = phdr.p_vaddr;
+        eh_info.hdr_size = phdr.p_memsz;
+      } else if (phdr.p_type == PT_NOTE && !note &&
+                 contains(phdr.p_vaddr, phdr.p_memsz)) {
+        for (u64 pos = phdr.p_vaddr;
+             pos + sizeof(Elf64_Nhdr) <= phdr.p_vaddr + phdr.p_memsz;) {
+          auto nhdr = reinterpret_cast<const Elf64_Nhdr*>(&image[pos]);
+          if (nhdr->n_type == 3 && nhdr->n_namesz == 4 &&
+              nhdr->n_descsz <= sizeof(header.gnu_build_id) &&
+              contains(pos, offsetof(GnuBuildId, build_id_raw) +
+                                nhdr->n_descsz) &&
+              !memcmp(&nhdr[1], "GNU", 4)) {
+            note = nhdr;
+            break;
+          }
+          pos += sizeof(*nhdr) + ALIGN_UP(u64(nhdr->n_namesz), 4) +
+                 ALIGN_UP(u64(nhdr->n_descsz), 4);
+        }
+      }
+    }
+    if (!dynamic) {
+      fputs("error: ELF has no PT_DYNAMIC\n", stderr);
+      return false;
+    }
+    ParseDynamic();
+
+    // Section headers are optional and only fill in what the segments lack
+    std::vector<Elf64_Shdr> shdrs;
+    if (ehdr.e_shentsize == sizeof(Elf64_Shdr) &&
+        ehdr.e_shoff <= file.size() &&
+        ehdr.e_shnum <= (file.size() - ehdr.e_shoff) / sizeof(Elf64_Shdr)) {
+      shdrs.resize(ehdr.e_shnum);
+      if (!shdrs.empty()) {
+        memcpy(shdrs.data(), &file[ehdr.e_shoff],
+               shdrs.size() * sizeof(Elf64_Shdr));
+      }
+    }
+    auto section_named = [&](const char* name) -> const Elf64_Shdr* {
+      if (ehdr.e_shstrndx >= shdrs.size()) {
+        return nullptr;
+      }
+      auto& shstrtab = shdrs[ehdr.e_shstrndx];
+      size_t len = strlen(name) + 1;
+      if (shstrtab.sh_offset > file.size() ||
+          shstrtab.sh_size > file.size() - shstrtab.sh_offset) {
+        return nullptr;
+      }
+      for (auto& shdr : shdrs) {
+        if (shdr.sh_name < shstrtab.sh_size &&
+            len <= shstrtab.sh_size - shdr.sh_name &&
+            !memcmp(&file[shstrtab.sh_offset + shdr.sh_name], name, len)) {
+          return &shdr;
+        }
+      }
+      return nullptr;
+    };
+
+    // The symbol count is the DT_HASH chain count, else the size of the
+    // .dynsym section header, else assume .dynstr follows .dynsym.
+    u64 dynsym_size = dyn_info.strtab > dyn_info.symtab
+                          ? dyn_info.strtab - dyn_info.symtab
+                          : 0;
+    if (dyn_info.hash && contains(dyn_info.hash, 2 * sizeof(u32))) {
+      u32 nchain;
+      memcpy(&nchain, &image[dyn_info.hash + sizeof(u32)], sizeof(nchain));
+      dynsym_size = u64(nchain) * sizeof(Elf64_Sym);
+    } else {
+      for (auto& shdr : shdrs) {
+        if (shdr.sh_type == SHT_DYNSYM && shdr.sh_addr == dyn_info.symtab) {
+          dynsym_size = shdr.sh_size;
+          break;
+        }
+      }
+    }
+    // The NSO model keeps .dynsym and .dynstr in .rodata
+    auto& rodata = header.segments[kRodata];
+    auto in_rodata = [&rodata](u64 addr, u64 size) {
+      return addr >= rodata.mem_offset && size <= rodata.mem_size &&
+             addr - rodata.mem_offset <= rodata.mem_size - size;
+    };
+    if (!in_rodata(dyn_info.symtab, dynsym_size) ||
+        !in_rodata(dyn_info.strtab, dyn_info.strsz)) {
+      fputs("error: ELF .dynsym and .dynstr must be in the r-- segment\n",
+            stderr);
+      return false;
+    }
+    header.dynsym = {static_cast<u32>(dyn_info.symtab - rodata.mem_offset),
+                     static_cast<u32>(dynsym_size)};
+    header.dynstr = {static_cast<u32>(dyn_info.strtab - rodata.mem_offset),
+                     static_cast<u32>(dyn_info.strsz)};
+    // No segment or dynamic tag describes .api_info
+    auto api_info = section_named(".api_info");
+    if (api_info && in_rodata(api_info->sh_addr, api_info->sh_size)) {
+      header.api_info = {
+          static_cast<u32>(api_info->sh_addr - rodata.mem_offset),
+          static_cast<u32>(api_info->sh_size)};
+    }
+
+    auto& text_seg = header.segments[kText];
+    ResolvePlt(&image[text_seg.mem_offset], text_seg.mem_size);
+    if (!note) {
+      FindBuildIdNote();
+    }
+    if (note) {
+      auto build_id = reinterpret_cast<const GnuBuildId*>(note);
+      memcpy(header.gnu_build_id.data(), build_id->build_id_raw.data(),
+             std::min<size_t>(note->n_descsz, header.gnu_build_id.size()));
+    }
+    file_type = kElf;
+    return true;
+  }
+  void ParseDynamic() {
+    for (auto dyn = dynamic; dyn->d_tag; dyn++) {
+#define DT_ASSIGN_U64(dt, var) \
+  case dt:                     \
+    dyn_info.var = dyn->d_un;  \
+    break;
+      switch (dyn->d_tag) {
+        DT_ASSIGN_U64(DT_SYMTAB, symtab);
+        DT_ASSIGN_U64(DT_RELA, rela);
+        DT_ASSIGN_U64(DT_RELASZ, relasz);
+        DT_ASSIGN_U64(DT_JMPREL, jmprel);
+        DT_ASSIGN_U64(DT_PLTRELSZ, pltrelsz);
+        DT_ASSIGN_U64(DT_STRTAB, strtab);
+        DT_ASSIGN_U64(DT_STRSZ, strsz);
+        DT_ASSIGN_U64(DT_PLTGOT, pltgot);
+        DT_ASSIGN_U64(DT_HASH, hash);
+        DT_ASSIGN_U64(DT_GNU_HASH, gnu_hash);
+        DT_ASSIGN_U64(DT_INIT, init);
+        DT_ASSIGN_U64(DT_FINI, fini);
+        DT_ASSIGN_U64(DT_INIT_ARRAY, init_array);
+        DT_ASSIGN_U64(DT_INIT_ARRAYSZ, init_arraysz);
+        DT_ASSIGN_U64(DT_FINI_ARRAY, fini_array);
+        DT_ASSIGN_U64(DT_FINI_ARRAYSZ, fini_arraysz);
+      }
+#undef DT_ASSIGN_U64
+    }
+  }
+  void FindBuildIdNote() {
+    // Kinda gross, but hopefully unique enough to avoid false positives...
+    const GnuBuildId md5_build_id_needle = {
+        {sizeof(GnuBuildId::owner), sizeof(GnuBuildId::build_id_md5), 3},
+        {'G', 'N', 'U'}};
+    const GnuBuildId sha1_build_id_needle = {
+        {sizeof(GnuBuildId::owner), sizeof(GnuBuildId::build_id_sha1), 3},
+        {'G', 'N', 'U'}};
+    for (auto i : {kRodata, kText, kData}) {
+      auto& seg = header.segments[i];
+      note = reinterpret_cast<Elf64_Nhdr*>(
+          memmemr(&image[seg.mem_offset], seg.mem_size, &md5_build_id_needle,
+                  offsetof(GnuBuildId, build_id_md5)));
+      if (note) {
+        break;
+      }
+      note = reinterpret_cast<Elf64_Nhdr*>(
+          memmemr(&image[seg.mem_offset], seg.mem_size, &sha1_build_id_needle,
+                  offsetof(GnuBuildId, build_id_sha1)));
+      if (note) {
+        break;
+      }
+    }
+  }
+  void DumpElfInfo() {
+    puts("dynamic:");
+    struct {
+      Elf64_Rela* rela;
+      u64 num_rela;
+      Elf64_Rela* jmprel;
+      u64 num_jmprel;
+    } rela_info;
+    for (auto dyn = dynamic; dyn->d_tag; dyn++) {
+      printf("%16" PRIx64 " %16" PRIx64 "\n", dyn->d_tag, dyn->d_un);
+
+#define DT_ASSIGN_PTR(dt, var, x)                                   \
+  case dt:                                                          \
+    rela_info.var = reinterpret_cast<decltype(rela_info.var)>((x)); \
+    break;
+#define DT_ASSIGN_U64(dt, var, x)                              \
+  case dt:                                                     \
+    rela_info.var = static_cast<decltype(rela_info.var)>((x)); \
+    break;
+
+      switch (dyn->d_tag) {
+        DT_ASSIGN_PTR(DT_RELA, rela, &image[dyn->d_un]);
+        DT_ASSIGN_U64(DT_RELASZ, num_rela, dyn->d_un / sizeof(*rela_info.rela));
+        DT_ASSIGN_PTR(DT_JMPREL, jmprel, &image[dyn->d_un]);
+        DT_ASSIGN_U64(DT_PLTRELSZ, num_jmprel,
+                      dyn->d_un / sizeof(*rela_info.jmprel));
+      }
+#undef DT_ASSIGN_U64
+#undef DT_ASSIGN_PTR
+    }
+    puts("rela:");
+    for (size_t i = 0; i < rela_info.num_rela; i++) {
+      auto& rela = rela_info.rela[i];
+      printf("%16" PRIx64 " %8x %8x %16" PRIx64 "\n", rela.r_offset,
+             ELF64_R_SYM(rela.r_info), ELF64_R_TYPE(rela.r_info),
+             rela.r_addend);
+    }
+    puts("jmprel:");
+    for (size_t i = 0; i < rela_info.num_jmprel; i++) {
+      auto& rela = rela_info.jmprel[i];
+      printf("%16" PRIx64 " %8x %8x %16" PRIx64 "x\n", rela.r_offset,
+             ELF64_R_SYM(rela.r_info), ELF64_R_TYPE(rela.r_info),
+             rela.r_addend);
+    }
+
+    auto rodata = &image[header.segments[kRodata].mem_offset];
+    auto dynstr = reinterpret_cast<const char*>(&rodata[header.dynstr.offset]);
+    puts("symbols:");
+    iter_dynsym([&](const Elf64_Sym& sym, u32) {
+      auto name = &dynstr[sym.st_name];
+      printf("%x %x %x %4x %16" PRIx64 " %16" PRIx64 " %s\n",
+             ELF64_ST_BIND(sym.st_info), ELF64_ST_TYPE(sym.st_info),
+             ELF64_ST_VISIBILITY(sym.st_other), sym.st_shndx, sym.st_value,
+             sym.st_size, name);
+    });
+  }
+  void iter_dynsym(std::function<void(const Elf64_Sym&, u32)> func) {
+    auto sym = reinterpret_cast<Elf64_Sym*>(&image[dyn_info.symtab]);
+    for (u32 i = 0; i < header.dynsym.size / sizeof(Elf64_Sym); i++, sym++) {
+      func(*sym, i);
+    }
+  }
+  // One string of .api_info, "<kind>+<vendor>+<name>", e.g.
+  // "SDK MW+Nintendo+NintendoSDK_nnSdk-4_4_0-Release". Strings with fewer
+  // parts leave the leading fields empty.
+  struct ApiInfoEntry {
+    std::string kind;
+    std::string vendor;
+    std::string name;
+  };
+  // Whether the header has a .api_info within .rodata
+  bool HasApiInfo() const {
+    auto& rodata = header.segments[kRodata];
+    auto& extent = header.api_info;
+    return extent.size && extent.offset <= rodata.mem_size &&
+           extent.size <= rodata.mem_size - extent.offset &&
+           u64(rodata.mem_offset) + rodata.mem_size <= image.size();
+  }
+  // The SDK and middleware libraries listed in .api_info, in order
+  std::vector<ApiInfoEntry> ApiInfo() const {
+    std::vector<ApiInfoEntry> entries;
+    if (!HasApiInfo()) {
+      return entries;
+    }
+    auto& rodata = header.segments[kRodata];
+    auto& extent = header.api_info;
+    auto p = reinterpret_cast<const char*>(
+        &image[rodata.mem_offset + extent.offset]);
+    auto end = p + extent.size;
+    while (p < end) {
+      auto len = strnlen(p, end - p);
+      if (len) {
+        std::string text(p, len);
+        ApiInfoEntry entry;
+        auto first = text.find('+');
+        auto second =
+            first == text.npos ? text.npos : text.find('+', first + 1);
+        if (second != text.npos) {
+          entry.kind = text.substr(0, first);
+          entry.vendor = text.substr(first + 1, second - first - 1);
+          entry.name = text.substr(second + 1);
+        } else {
+          entry.name = std::move(text);
+        }
+        entries.push_back(std::move(entry));
+      }
+      p += len + 1;
+    }
+    return entries;
+  }
+  const char* GetDynstr() {
+    auto rodata = &image[header.segments[kRodata].mem_offset];
+    return reinterpret_cast<const char*>(&rodata[header.dynstr.offset]);
+  }
+  // Returns the segment containing vaddr (.bss counts as kData), or
+  // kNumSegment.
+  int SegmentOf(u64 vaddr) const {
+    for (int i = 0; i < kNumSegment; i++) {
+      auto& seg = header.segments[i];
+      u64 end = seg.mem_offset + seg.mem_size;
+      if (i == kData) {
+        end += seg.bss_align;
+      }
+      if (vaddr >= seg.mem_offset && vaddr < end) {
+        return i;
+      }
+    }
+    return kNumSegment;
+  }
+  // Sorts named, defined .dynsym entries by address for FindSymbol.
+  void BuildSymbolIndex() {
+    symbols_by_addr.clear();
+    iter_dynsym([&](const Elf64_Sym& sym, u32) {
+      if (sym.st_shndx == SHN_UNDEF || sym.st_name == 0 ||
+          ELF64_ST_TYPE(sym.st_info) == STT_SECTION) {
+        return;
+      }
+      symbols_by_addr.push_back(&sym);
+    });
+    std::stable_sort(symbols_by_addr.begin(), symbols_by_addr.end(),
+                     [](const Elf64_Sym* a, const Elf64_Sym* b) {
+                       return a->st_value < b->st_value;
+                     });
+  }
+  // Nearest symbol at or before vaddr within the same segment. Requires
+  // BuildSymbolIndex.
+  const Elf64_Sym* FindSymbol(u64 vaddr) const {
+    auto it = std::upper_bound(
+        symbols_by_addr.begin(), symbols_by_addr.end(), vaddr,
+        [](u64 addr, const Elf64_Sym* sym) { return addr < sym->st_value; });
+    if (it == symbols_by_addr.begin()) {
+      return nullptr;
+    }
+    auto sym = *--it;
+    // rewind to the first of several aliases
+    while (it != symbols_by_addr.begin() && it[-1]->st_value == sym->st_value) {
+      sym = *--it;
+    }
+    if (SegmentOf(sym->st_value) != SegmentOf(vaddr)) {
+      return nullptr;
+    }
+    return sym;
+  }
+  ImageView GetView() {
+    ImageView view{};
+    view.image = image.data();
+    view.image_size = image.size();
+    for (int i = 0; i < kNumSegment; i++) {
+      auto& seg = header.segments[i];
+      view.segments[i] = {seg.mem_offset, seg.mem_size,
+                          i == kData ? seg.bss_align : 0};
+    }
+    view.build_id = header.gnu_build_id.data();
+    view.build_id_size = header.gnu_build_id.size();
+    if (note && note->n_descsz < view.build_id_size) {
+      view.build_id_size = note->n_descsz;
+    }
+    if (has_image_hash) {
+      view.image_hash = image_hash.data();
+    }
+
+    auto table = [&](u64 addr, u64 size, size_t entsize,
+                     size_t* count) -> const u8* {
+      *count = 0;
+      if (!addr || !view.Contains(addr, size)) {
+        return nullptr;
+      }
+      *count = size / entsize;
+      return &image[addr];
+    };
+    auto dynamic_addr = reinterpret_cast<uintptr_t>(dynamic) -
+                        reinterpret_cast<uintptr_t>(&image[0]);
+    for (u64 addr = dynamic_addr; view.Contains(addr, sizeof(Elf64_Dyn));
+         addr += sizeof(Elf64_Dyn)) {
+      view.num_dynamic++;
+      if (reinterpret_cast<const Elf64_Dyn*>(&image[addr])->d_tag == DT_NULL) {
+        break;
+      }
+    }
+    view.dynamic = dynamic;
+    u64 rodata = header.segments[kRodata].mem_offset;
+    view.dynsym = reinterpret_cast<const Elf64_Sym*>(
+        table(rodata + header.dynsym.offset, header.dynsym.size,
+              sizeof(Elf64_Sym), &view.num_dynsym));
+    view.dynstr = reinterpret_cast<const char*>(
+        table(rodata + header.dynstr.offset, header.dynstr.size, sizeof(char),
+              &view.dynstr_size));
+    view.rela = reinterpret_cast<const Elf64_Rela*>(table(
+        dyn_info.rela, dyn_info.relasz, sizeof(Elf64_Rela), &view.num_rela));
+    view.jmprel = reinterpret_cast<const Elf64_Rela*>(
+        table(dyn_info.jmprel, dyn_info.pltrelsz, sizeof(Elf64_Rela),
+              &view.num_jmprel));
+    view.plt_addr = plt_info.addr;
+    view.plt_size = plt_info.size;
+    view.eh_frame_hdr_addr = eh_info.hdr_addr;
+    view.eh_frame_hdr_size = eh_info.hdr_size;
+    view.hash_addr = dyn_info.hash;
+    view.gnu_hash_addr = dyn_info.gnu_hash;
+    if (HasApiInfo()) {
+      view.api_info_addr = rodata + header.api_info.offset;
+      view.api_info_size = header.api_info.size;
+    }
+    return view;
+  }
+  bool WriteUncompressedNso(const fs::path& path) {
+    std::vector<u8> data;
+    BuildUncompressedNso(&data);
+    return File::Write(path, data);
+  }
+  void BuildUncompressedNso(std::vector<u8>* out) {
+    NsoHeader new_header = header;
+    // clear compression flags
+    new_header.flags &= 0xf8;
+    // fix segment offsets and size
+    for (int i = 0; i < kNumSegment; i++) {
+      new_header.segments[i].file_offset = new_header.segments[i].mem_offset + sizeof(NsoHeader);
+      new_header.segment_file_sizes[i] = new_header.segments[i].mem_size;
+    }
+    new_header.segments[kText].bss_align = 0x100;
+    new_header.segments[kRodata].bss_align = 0;
+
+    u32 image_size = new_header.segments[kData].mem_offset + 
+                     new_header.segments[kData].mem_size;
+    auto& data = *out;
+    data = std::vector<u8>(sizeof(NsoHeader) + image_size);
+    memcpy(data.data(), &new_header, sizeof(NsoHeader));
+    memcpy(data.data() + sizeof(NsoHeader), image.data(), image_size);
+  }
+  bool WriteElf(const fs::path& path, const PassResults* passes = nullptr) {
+    std::vector<u8> elf;
+    BuildElf(&elf, passes);
+    return File::Write(path, elf);
+  }
+  void BuildElf(std::vector<u8>* out, const PassResults* passes = nullptr) {
+    StringTable shstrtab;
+    shstrtab.AddString(".shstrtab");
+
+    // Profile sections based on dynsym
+    u16 num_shdrs = 0;
+    std::unordered_map<u16, Elf64_Shdr> known_sections;
+    auto vaddr_to_shdr = [&](u64 vaddr) {
+      Elf64_Shdr shdr{};
+      for (int i = 0; i < kNumSegment; i++) {
+        u64 location = vaddr;
+        auto& seg = header.segments[i];
+        auto seg_mem_end = seg.mem_offset + seg.mem_size;
+        // sh_offset will be fixed up later
+        if (location >= seg.mem_offset && location < seg_mem_end) {
+          // .text, .data, .rodata
+          const char* name = "";
+          shdr.sh_type = SHT_PROGBITS;
+          switch (i) {
+          case kText:
+            shdr.sh_flags = SHF_ALLOC | SHF_EXECINSTR;
+            name = ".text";
+            break;
+          case kData:
+            shdr.sh_flags = SHF_ALLOC | SHF_WRITE;
+            name = ".data";
+            break;
+          case kRodata:
+            shdr.sh_flags = SHF_ALLOC;
+            name = ".rodata";
+            break;
+          }
+          shstrtab.AddString(name);
+          shdr.sh_name = shstrtab.GetOffset(name);
+          shdr.sh_addr = seg.mem_offset;
+          shdr.sh_size = seg.mem_size;
+          shdr.sh_addralign = sizeof(u64);
+        } else if (i == kData && (location >= seg_mem_end &&
+                                  location <= seg_mem_end + seg.bss_align)) {
+          // .bss
+          const char* name = ".bss";
+          shstrtab.AddString(name);
+          shdr.sh_name = shstrtab.GetOffset(name);
+          shdr.sh_type = SHT_NOBITS;
+          shdr.sh_flags = SHF_ALLOC | SHF_WRITE;
+          shdr.sh_addr = seg_mem_end;
+          shdr.sh_size = seg.bss_align;
+          shdr.sh_addralign = sizeof(u64);
+        }
+      }
+      return shdr;
+    };
+    iter_dynsym([&](const Elf64_Sym& sym, u32) {
+      if (sym.st_shndx >= SHN_LORESERVE) {
+        return;
+      }
+      num_shdrs = std::max(num_shdrs, sym.st_shndx);
+      if (sym.st_shndx != SHT_NULL && !known_sections.count(sym.st_shndx)) {
+        auto shdr = vaddr_to_shdr(sym.st_value);
+        if (shdr.sh_type != SHT_NULL) {
+          known_sections[sym.st_shndx] = shdr;
+        } else {
+          fprintf(stderr, "failed to make shdr for st_shndx %d\n",
+                  sym.st_shndx);
+        }
+      }
+    });
+    // Check if we need to manually add the known segments (nothing was pointing
+    // to them, so they can go anywhere).
+    if (known_sections.size() != kNumSegment + 1) {
+      auto next_free = [&known_sections](u16 start) -> u16 {
+        for (u16 i = start + 1; i < SHN_LORESERVE; i++) {
+          if (!known_sections.count(i)) {
+            return i;
+          }
+        }
+        return SHN_UNDEF;
+      };
+      u16 shndx = next_free(SHN_UNDEF);
+      if (shndx != SHN_UNDEF && !shstrtab.GetOffset(".text") &&
+          header.segments[kText].mem_size > 0) {
+        known_sections[shndx] =
+            vaddr_to_shdr(header.segments[kText].mem_offset);
+        shndx = next_free(shndx);
+      }
+      if (shndx != SHN_UNDEF && !shstrtab.GetOffset(".rodata") &&
+          header.segments[kRodata].mem_size > 0) {
+        known_sections[shndx] =
+            vaddr_to_shdr(header.segments[kRodata].mem_offset);
+        shndx = next_free(shndx);
+      }
+      if (shndx != SHN_UNDEF && !shstrtab.GetOffset(".data") &&
+          header.segments[kData].mem_size > 0) {
+        known_sections[shndx] =
+            vaddr_to_shdr(header.segments[kData].mem_offset);
+        shndx = next_free(shndx);
+      }
+      if (shndx != SHN_UNDEF && !shstrtab.GetOffset(".bss") &&
+          header.segments[kData].bss_align > 0) {
+        known_sections[shndx] =
+            vaddr_to_shdr(header.segments[kData].mem_offset +
+                          header.segments[kData].mem_size);
+        shndx = next_free(shndx);
+      }
+    }
+    // +1 to go from index -> count
+    num_shdrs++;
+
+    // Determine how many other sections are needed
+    int shdrs_needed = static_cast<int>(known_sections.size()) - num_shdrs;
+    // index 0
+    shdrs_needed++;
+    // .shstrtab
+    shdrs_needed++;
+    // Assume the following will always be present: .dynstr, .dynsym, .dynamic,
+    // .rela.dyn
+    for (auto& name : {".dynstr", ".dynsym", ".dynamic", ".rela.dyn"}) {
+      shstrtab.AddString(name);
+      shdrs_needed++;
+    }
+
+    struct {
+      bool plt;
+      bool got;
+      bool got_plt;
+      bool rela_plt;
+      bool hash;
+      bool gnu_hash;
+      bool init;
+      bool fini;
+      bool init_array;
+      bool fini_array;
+      bool note;
+      bool api_info;
+      bool eh;
+    } present{};
+#define ALLOC_SHDR_IF(condition, name) \
+  if ((condition)) {                   \
+    present.name = true;               \
+    shdrs_needed++;                    \
+  }
+    ALLOC_SHDR_IF(plt_info.addr, plt);
+    u64 jump_slot_addr_end = 0;
+    if (dyn_info.jmprel) {
+      for (size_t i = 0; i < dyn_info.pltrelsz / sizeof(Elf64_Rela); i++) {
+        auto& rela = reinterpret_cast<Elf64_Rela*>(&image[dyn_info.jmprel])[i];
+        if (ELF64_R_TYPE(rela.r_info) == R_AARCH64_JUMP_SLOT) {
+          jump_slot_addr_end =
+              std::max(jump_slot_addr_end, rela.r_offset + sizeof(u64));
+        }
+      }
+    }
+    ALLOC_SHDR_IF(jump_slot_addr_end && dyn_info.pltgot, got_plt);
+    u64 got_addr = 0;
+    if (jump_slot_addr_end) {
+      u64 got_dynamic_ptr = reinterpret_cast<uintptr_t>(dynamic) -
+                            reinterpret_cast<uintptr_t>(&image[0]);
+      auto found = static_cast<u8*>(
+          memmem(&image[jump_slot_addr_end], image.size() - jump_slot_addr_end,
+                 &got_dynamic_ptr, sizeof(got_dynamic_ptr)));
+      if (found) {
+        got_addr = found - &image[0];
+      }
+    }
+    ALLOC_SHDR_IF(got_addr && dyn_info.rela, got);
+    ALLOC_SHDR_IF(present.got_plt && dyn_info.jmprel && dyn_info.pltrelsz,
+                  rela_plt);
+    ALLOC_SHDR_IF(dyn_info.hash, hash);
+    ALLOC_SHDR_IF(dyn_info.gnu_hash, gnu_hash);
+    ALLOC_SHDR_IF(dyn_info.init_array && dyn_info.init_arraysz, init_array);
+    ALLOC_SHDR_IF(dyn_info.fini_array && dyn_info.fini_arraysz, fini_array);
+    ALLOC_SHDR_IF(note, note);
+    ALLOC_SHDR_IF(HasApiInfo(), api_info);
+    u32 init_ret_offset = 0;
+    if (dyn_info.init) {
+      auto init_ptr = reinterpret_cast<u32*>(&image[dyn_info.init]);
+      for (int i = 0;; i++) {
+        if (init_ptr[i] == 0xd65f03c0ul) {
+          init_ret_offset = (i + 1) * sizeof(u32);
+          break;
+        }
+      }
+      ALLOC_SHDR_IF(init_ret_offset, init);
+    }
+    u32 fini_branch_offset = 0;
+    if (dyn_info.fini) {
+      auto fini_ptr = reinterpret_cast<u32*>(&image[dyn_info.fini]);
+      for (int i = 0; i < 0x20; i++) {
+        if ((fini_ptr[i] & 0xff000000ul) == 0x14000000ul) {
+          fini_branch_offset = (i + 1) * sizeof(u32);
+          break;
+        }
+      }
+      ALLOC_SHDR_IF(fini_branch_offset, fini);
+    }
+#undef ALLOC_SHDR_IF
+
+    ElfEHInfo eh;
+    uintptr_t eh_frame_ptr;
+    if (eh.MeasureFrame(
+            reinterpret_cast<eh_frame_hdr*>(&image[eh_info.hdr_addr]),
+            &eh_frame_ptr, &eh_info.frame_size)) {
+      eh_info.frame_addr =
+          eh_info.hdr_addr + (eh_frame_ptr - reinterpret_cast<uintptr_t>(
+                                                 &image[eh_info.hdr_addr]));
+      // XXX the alignment of sizes is a fudge...
+      eh_info.hdr_size = ALIGN_UP(eh_info.hdr_size, 0x10);
+      eh_info.frame_size = ALIGN_UP(eh_info.frame_size, 0x10);
+      present.eh = true;
+      // Account for .eh_frame_hdr and .eh_frame
+      shdrs_needed += 2;
+      shstrtab.AddString(".eh_frame_hdr");
+      shstrtab.AddString(".eh_frame");
+    }
+
+    if (present.plt)
+      shstrtab.AddString(".plt");
+    if (present.got)
+      shstrtab.AddString(".got");
+    if (present.got_plt)
+      shstrtab.AddString(".got.plt");
+    if (present.rela_plt)
+      shstrtab.AddString(".rela.plt");
+    if (present.hash)
+      shstrtab.AddString(".hash");
+    if (present.gnu_hash)
+      shstrtab.AddString(".gnu.hash");
+    if (present.init)
+      shstrtab.AddString(".init");
+    if (present.fini)
+      shstrtab.AddString(".fini");
+    if (present.init_array)
+      shstrtab.AddString(".init_array");
+    if (present.fini_array)
+      shstrtab.AddString(".fini_array");
+    if (present.note)
+      shstrtab.AddString(".note");
+    if (present.api_info)
+      shstrtab.AddString(".api_info");
+
+    std::vector<const PassSection*> pass_sections;
+    std::vector<const PassSymbol*> pass_symbols;
+    std::unordered_map<u32, u64> dynsym_sizes;
+    if (passes) {
+      for (auto& result : *passes) {
+        for (auto& section : result.second.sections) {
+          pass_sections.push_back(&section);
+          shstrtab.AddString(section.name.c_str());
+          shdrs_needed++;
+        }
+        for (auto& symbol : result.second.symbols) {
+          pass_symbols.push_back(&symbol);
+        }
+        dynsym_sizes.insert(result.second.dynsym_sizes.begin(),
+                            result.second.dynsym_sizes.end());
+      }
+    }
+
+    // Symbols from passes go into a .symtab which also repeats .dynsym, so
+    // tools which only read one symbol table see everything. Inferred sizes
+    // only apply to the .symtab copies.
+    StringTable strtab;
+    std::vector<Elf64_Sym> symtab;
+    u32 symtab_num_local = 0;
+    if (!pass_symbols.empty() || !dynsym_sizes.empty()) {
+      shstrtab.AddString(".symtab");
+      shstrtab.AddString(".strtab");
+      shdrs_needed += 2;
+      auto dynstr = GetDynstr();
+      auto addr_to_shndx = [&](u64 vaddr) -> u16 {
+        for (auto& known_section : known_sections) {
+          auto& known_shdr = known_section.second;
+          if (vaddr >= known_shdr.sh_addr &&
+              vaddr < known_shdr.sh_addr + known_shdr.sh_size) {
+            return known_section.first;
+          }
+        }
+        return SHN_ABS;
+      };
+      symtab.push_back({});
+      for (bool local : {true, false}) {
+        iter_dynsym([&](const Elf64_Sym& sym, u32 index) {
+          if (index == 0 ||
+              (ELF64_ST_BIND(sym.st_info) == STB_LOCAL) != local) {
+            return;
+          }
+          auto name = &dynstr[sym.st_name];
+          strtab.AddString(name);
+          symtab.push_back(sym);
+          symtab.back().st_name = strtab.GetOffset(name);
+          auto size = dynsym_sizes.find(index);
+          if (!sym.st_size && size != dynsym_sizes.end()) {
+            symtab.back().st_size = size->second;
+          }
+        });
+        for (auto symbol : pass_symbols) {
+          if ((symbol->bind == STB_LOCAL) != local) {
+            continue;
+          }
+          auto name = symbol->name.c_str();
+          strtab.AddString(name);
+          Elf64_Sym sym{};
+          sym.st_name = strtab.GetOffset(name);
+          sym.st_info = ELF64_ST_INFO(symbol->bind, symbol->type);
+          sym.st_shndx = addr_to_shndx(symbol->value);
+          sym.st_value = symbol->value;
+          sym.st_size = symbol->size;
+          symtab.push_back(sym);
+        }
+        if (local) {
+          symtab_num_local = static_cast<u32>(symtab.size());
+        }
+      }
+      strtab.Finalize();
+    }
+
+    shstrtab.Finalize();
+    if (shdrs_needed > 0) {
+      num_shdrs += shdrs_needed;
+    }
+
+    // Add dynamic and EH segments
+    u16 num_phdrs = kNumSegment + 2;
+
+    size_t elf_size = sizeof(Elf64_Ehdr) + sizeof(Elf64_Phdr) * num_phdrs +
+                      sizeof(Elf64_Shdr) * num_shdrs;
+    elf_size += shstrtab.size;
+    for (auto& seg : header.segments) {
+      elf_size += seg.mem_size;
+    }
+    // Contents which are not part of the image go after the segments
+    auto reserve = [&elf_size](size_t size, size_t align) -> u64 {
+      elf_size = ALIGN_UP(elf_size, std::max<size_t>(align, 1));
+      elf_size += size;
+      return elf_size - size;
+    };
+    std::vector<u64> pass_section_offsets;
+    for (auto section : pass_sections) {
+      pass_section_offsets.push_back(
+          (section->flags & SHF_ALLOC)
+              ? 0
+              : reserve(section->data.size(), section->addralign));
+    }
+    u64 symtab_offset = reserve(symtab.size() * sizeof(Elf64_Sym), sizeof(u64));
+    u64 strtab_offset = reserve(strtab.buffer.size(), sizeof(char));
+    auto& elf = *out;
+    elf = std::vector<u8>(elf_size);
+
+    auto ehdr = reinterpret_cast<Elf64_Ehdr*>(&elf[0]);
+    ehdr->e_ident = {ELF_MAGIC,  ELFCLASS64,    ELFDATA2LSB,
+                     EV_CURRENT, ELFOSABI_NONE, 0};
+    ehdr->e_type = ET_DYN;
+    ehdr->e_machine = EM_AARCH64;
+    ehdr->e_version = EV_CURRENT;
+    ehdr->e_ehsize = sizeof(Elf64_Ehdr);
+    ehdr->e_flags = 0;
+    ehdr->e_entry = header.segments[kText].mem_offset;
+    ehdr->e_phoff = ehdr->e_ehsize;
+    ehdr->e_phentsize = sizeof(Elf64_Phdr);
+    ehdr->e_phnum = num_phdrs;
+    ehdr->e_shoff = ehdr->e_phoff + ehdr->e_phentsize * ehdr->e_phnum;
+    ehdr->e_shentsize = sizeof(Elf64_Shdr);
+    ehdr->e_shnum = num_shdrs;
+    ehdr->e_shstrndx = SHN_UNDEF;
+
+    // IDA only _needs_ phdrs and dynamic phdr to give good results
+    auto phdrs = reinterpret_cast<Elf64_Phdr*>(&elf[0] + ehdr->e_phoff);
+
+    auto vaddr_to_foffset = [&](u64 vaddr) -> u64 {
+      for (size_t i = 0; i < kNumSegment; i++) {
+        auto phdr = &phdrs[i];
+        if (vaddr >= phdr->p_vaddr && vaddr < phdr->p_vaddr + phdr->p_filesz) {
+          return phdr->p_offset + (vaddr - phdr->p_vaddr);
+        }
+      }
+      return 0;
+    };
+
+    shstrtab.offset = ehdr->e_shoff + ehdr->e_shentsize * ehdr->e_shnum;
+    memcpy(&elf[shstrtab.offset], &shstrtab.buffer[0], shstrtab.buffer.size());
+
+    size_t data_offset_cur = shstrtab.offset + shstrtab.size;
+    for (size_t i = 0; i < num_phdrs; i++) {
+      auto phdr = &phdrs[i];
+      if (i < kNumSegment) {
+        auto& seg = header.segments[i];
+        phdr->p_type = PT_LOAD;
+        switch (i) {
+        case kText:
+          phdr->p_flags = PF_R | PF_X;
+          break;
+        case kRodata:
+          phdr->p_flags = PF_R;
+          break;
+        case kData:
+          phdr->p_flags = PF_R | PF_W;
+          break;
+        }
+        phdr->p_vaddr = phdr->p_paddr = seg.mem_offset;
+        phdr->p_offset = data_offset_cur;
+        phdr->p_filesz = seg.mem_size;
+        if (i == kData) {
+          phdr->p_memsz = seg.mem_size + seg.bss_align;
+          phdr->p_align = 1;
+        } else {
+          phdr->p_memsz = seg.mem_size;
+          phdr->p_align = std::max(1u, seg.bss_align);
+        }
+
+        memcpy(&elf[0] + phdr->p_offset, &image[seg.mem_offset],
+               phdr->p_filesz);
+
+        // fixup sh_offset
+        for (auto& known_section : known_sections) {
+          if (known_section.second.sh_addr == phdr->p_vaddr) {
+            known_section.second.sh_offset = phdr->p_offset;
+          }
+        }
+
+        data_offset_cur += phdr->p_filesz;
+      } else if (i == kData + 1) {
+        phdr->p_type = PT_DYNAMIC;
+        phdr->p_flags = PF_R | PF_W;
+        phdr->p_vaddr = phdr->p_paddr = reinterpret_cast<uintptr_t>(dynamic) -
+                                        reinterpret_cast<uintptr_t>(&image[0]);
+        phdr->p_offset = vaddr_to_foffset(phdr->p_vaddr);
+        size_t dyn_size = sizeof(Elf64_Dyn);
+        for (auto dyn = dynamic; dyn->d_tag; dyn++) {
+          dyn_size += sizeof(Elf64_Dyn);
+        }
+        phdr->p_filesz = phdr->p_memsz = dyn_size;
+        phdr->p_align = sizeof(u64);
+      } else if (i == kData + 2) {
+        // Too bad ida doesn't fucking use it!
+        phdr->p_type = PT_GNU_EH_FRAME;
+        phdr->p_flags = PF_R;
+        phdr->p_vaddr = phdr->p_paddr = eh_info.hdr_addr;
+        phdr->p_offset = vaddr_to_foffset(phdr->p_vaddr);
+        phdr->p_filesz = phdr->p_memsz = eh_info.hdr_size;
+        phdr->p_align = sizeof(u32);
+      }
+    }
+
+    // IDA's elf loader will also look for certain sections...
+    // IMO this is IDA bug - it should just use PT_DYNAMIC
+    // At least on 6.95, IDA will do a decent job if only PT_DYNAMIC is
+    // there, but once SHT_DYNAMIC is added, then many entries which would
+    // otherwise work fine by being only in the dynamic section, must also
+    // have section headers...
+    auto shdrs = reinterpret_cast<Elf64_Shdr*>(&elf[0] + ehdr->e_shoff);
+    // Insert sections for which section index was known
+    for (auto& known_section : known_sections) {
+      auto shdr = &shdrs[known_section.first];
+      *shdr = known_section.second;
+    }
+    // Insert other handy sections at an available section index
+    auto insert_shdr = [&](const Elf64_Shdr& shdr,
+                           bool ordered = false) -> u32 {
+      u32 start = 1;
+      // This is basically a hack to convince ida not to delete segments
+      if (ordered) {
+        for (auto& known_section : known_sections) {
+          auto& known_shdr = known_section.second;
+          if (shdr.sh_addr >= known_shdr.sh_addr &&
+              shdr.sh_addr < known_shdr.sh_addr + known_shdr.sh_size) {
+            start = known_section.first + 1;
+          }
+        }
+      }
+    retry:
+      for (u32 i = start; i < num_shdrs; i++) {
+        if (shdrs[i].sh_type == SHT_NULL) {
+          shdrs[i] = shdr;
+          return i;
+        }
+      }
+      // failed to find open spot with restrictions, so try again at any
+      // location
+      if (ordered && start != 1) {
+        fprintf(stderr,
+                "warning: failed to meet ordering for sh_addr %16" PRIx64 "\n",
+                shdr.sh_addr);
+        start = 1;
+        goto retry;
+      }
+      return SHN_UNDEF;
+    };
+
+    Elf64_Shdr shdr;
+
+    if (present.init) {
+      shdr = {};
+      shdr.sh_name = shstrtab.GetOffset(".init");
+      shdr.sh_type = SHT_PROGBITS;
+      shdr.sh_flags = SHF_ALLOC | SHF_EXECINSTR;
+      shdr.sh_addr = dyn_info.init;
+      shdr.sh_offset = vaddr_to_foffset(shdr.sh_addr);
+      shdr.sh_size = init_ret_offset;
+      shdr.sh_addralign = sizeof(u32);
+      if (insert_shdr(shdr, true) == SHN_UNDEF) {
+        fputs("failed to insert new shdr for .init", stderr);
+      }
+    }
+
+    if (present.fini) {
+      shdr = {};
+      shdr.sh_name = shstrtab.GetOffset(".fini");
+      shdr.sh_type = SHT_PROGBITS;
+      shdr.sh_flags = SHF_ALLOC | SHF_EXECINSTR;
+      shdr.sh_addr = dyn_info.fini;
+      shdr.sh_offset = vaddr_to_foffset(shdr.sh_addr);
+      shdr.sh_size = fini_branch_offset;
+      shdr.sh_addralign = sizeof(u32);
+      if (insert_shdr(shdr, true) == SHN_UNDEF) {
+        fputs("failed to insert new shdr for .fini", stderr);
+      }
+    }
+
+    shdr = {};
+    shdr.sh_name = shstrtab.GetOffset(".dynstr");
+    shdr.sh_type = SHT_STRTAB;
+    shdr.sh_flags = SHF_ALLOC;
+    shdr.sh_addr = header.segments[kRodata].mem_offset + header.dynstr.offset;
+    shdr.sh_offset = phdrs[kRodata].p_offset + header.dynstr.offset;
+    shdr.sh_size = header.dynstr.size;
+    shdr.sh_addralign = sizeof(char);
+    u32 dynstr_shndx = insert_shdr(shdr);
+    if (dynstr_shndx == SHN_UNDEF) {
+      fputs("failed to insert new shdr for .dynstr", stderr);
+    }
+
+    u32 last_local_dynsym_index = 0;
+    iter_dynsym([&](const Elf64_Sym& sym, u32 index) {
+      if (ELF64_ST_BIND(sym.st_info) == STB_LOCAL) {
+        last_local_dynsym_index = std::max(last_local_dynsym_index, index);
+      }
+    });
+    shdr = {};
+    shdr.sh_name = shstrtab.GetOffset(".dynsym");
+    shdr.sh_type = SHT_DYNSYM;
+    shdr.sh_flags = SHF_ALLOC;
+    shdr.sh_addr = header.segments[kRodata].mem_offset + header.dynsym.offset;
+    shdr.sh_offset = phdrs[kRodata].p_offset + header.dynsym.offset;
+    shdr.sh_size = header.dynsym.size;
+    shdr.sh_link = dynstr_shndx;
+    shdr.sh_info = last_local_dynsym_index + 1;
+    shdr.sh_addralign = sizeof(u64);
+    shdr.sh_entsize = sizeof(Elf64_Sym);
+    u32 dynsym_shndx = insert_shdr(shdr);
+    if (dynsym_shndx == SHN_UNDEF) {
+      fputs("failed to insert new shdr for .dynsym", stderr);
+    }
+
+    auto dyn_phdr = &phdrs[kData + 1];
+    shdr = {};
+    shdr.sh_name = shstrtab.GetOffset(".dynamic");
+    shdr.sh_type = SHT_DYNAMIC;
+    shdr.sh_flags = SHF_ALLOC | SHF_WRITE;
+    shdr.sh_addr = dyn_phdr->p_vaddr;
+    shdr.sh_offset = dyn_phdr->p_offset;
+    shdr.sh_size = dyn_phdr->p_filesz;
+    shdr.sh_link = dynstr_shndx;
+    shdr.sh_addralign = dyn_phdr->p_align;
+    shdr.sh_entsize = sizeof(Elf64_Dyn);
+    if (insert_shdr(shdr) == SHN_UNDEF) {
+      fputs("failed to insert new shdr for .dynamic", stderr);
+    }
+
+    shdr = {};
+    shdr.sh_name = shstrtab.GetOffset(".rela.dyn");
+    shdr.sh_type = SHT_RELA;
+    shdr.sh_flags = SHF_ALLOC;
+    shdr.sh_addr = dyn_info.rela;
+    shdr.sh_offset = vaddr_to_foffset(shdr.sh_addr);
+    shdr.sh_size = dyn_info.relasz;
+    shdr.sh_link = dynsym_shndx;
+    shdr.sh_addralign = sizeof(u64);
+    shdr.sh_entsize = sizeof(Elf64_Rela);
+    if (insert_shdr(shdr) == SHN_UNDEF) {
+      fputs("failed to insert new shdr for .rela.dyn", stderr);
+    }
+
+    u32 plt_shndx = SHN_UNDEF;
+    if (present.plt) {
+      shdr = {};
+      shdr.sh_name = shstrtab.GetOffset(".plt");
+      shdr.sh_type = SHT_PROGBITS;
+      shdr.sh_flags = SHF_ALLOC | SHF_EXECINSTR;
+      shdr.sh_addr = plt_info.addr;
+      shdr.sh_offset = vaddr_to_foffset(shdr.sh_addr);
+      shdr.sh_size = plt_info.size;
+      shdr.sh_addralign = 0x10;
+      shdr.sh_entsize = 0x10;
+      plt_shndx = insert_shdr(shdr, true);
+      if (plt_shndx == SHN_UNDEF) {
+        fputs("failed to insert new shdr for .plt", stderr);
+      }
+    }
+
+    if (present.got) {
+      u64 glob_dat_end = got_addr;
+      for (size_t i = 0; i < dyn_info.relasz / sizeof(Elf64_Rela); i++) {
+        auto& rela = reinterpret_cast<Elf64_Rela*>(&image[dyn_info.rela])[i];
+        if (ELF64_R_TYPE(rela.r_info) == R_AARCH64_GLOB_DAT) {
+          glob_dat_end = std::max(glob_dat_end, rela.r_offset + sizeof(u64));
+        }
+      }
+      shdr = {};
+      shdr.sh_name = shstrtab.GetOffset(".got");
+      shdr.sh_type = SHT_PROGBITS;
+      shdr.sh_flags = SHF_ALLOC | SHF_WRITE;
+      shdr.sh_addr = got_addr;
+      shdr.sh_offset = vaddr_to_foffset(shdr.sh_addr);
+      shdr.sh_size = glob_dat_end - got_addr;
+      shdr.sh_addralign = sizeof(u64);
+      shdr.sh_entsize = sizeof(u64);
+      if (insert_shdr(shdr, true) == SHN_UNDEF) {
+        fputs("failed to insert new shdr for .got", stderr);
+      }
+    }
+
+    if (present.got_plt) {
+      shdr = {};
+      shdr.sh_name = shstrtab.GetOffset(".got.plt");
+      shdr.sh_type = SHT_PROGBITS;
+      shdr.sh_flags = SHF_ALLOC | SHF_WRITE;
+      shdr.sh_addr = dyn_info.pltgot;
+      shdr.sh_offset = vaddr_to_foffset(shdr.sh_addr);
+      shdr.sh_size = jump_slot_addr_end - dyn_info.pltgot;
+      shdr.sh_addralign = sizeof(u64);
+      shdr.sh_entsize = sizeof(u64);
+      if (insert_shdr(shdr, true) == SHN_UNDEF) {
+        fputs("failed to insert new shdr for .got.plt", stderr);
+      }
+    }
+
+    if (present.rela_plt) {
+      if (!present.plt) {
+        fputs("warning: .rela.plt with no .plt", stderr);
+      }
+      shdr = {};
+      shdr.sh_name = shstrtab.GetOffset(".rela.plt");
+      shdr.sh_type = SHT_RELA;
+      shdr.sh_flags = SHF_ALLOC;
+      if (plt_shndx != SHN_UNDEF) {
+        shdr.sh_flags |= SHF_INFO_LINK;
+      }
+      shdr.sh_addr = dyn_info.jmprel;
+      shdr.sh_offset = vaddr_to_foffset(shdr.sh_addr);
+      shdr.sh_size = dyn_info.pltrelsz;
+      shdr.sh_link = dynsym_shndx;
+      shdr.sh_info = plt_shndx;
+      shdr.sh_addralign = sizeof(u64);
+      shdr.sh_entsize = sizeof(Elf64_Rela);
+      if (insert_shdr(shdr) == SHN_UNDEF) {
+        fputs("failed to insert new shdr for .rela.plt", stderr);
+      }
+    }
+
+    if (present.init_array) {
+      shdr = {};
+      shdr.sh_name = shstrtab.GetOffset(".init_array");
+      shdr.sh_type = SHT_INIT_ARRAY;
+      shdr.sh_flags = SHF_ALLOC | SHF_WRITE;
+      shdr.sh_addr = dyn_info.init_array;
+      shdr.sh_offset = vaddr_to_foffset(shdr.sh_addr);
+      shdr.sh_size = dyn_info.init_arraysz;
+      shdr.sh_addralign = sizeof(u64);
+      if (insert_shdr(shdr, true) == SHN_UNDEF) {
+        fputs("failed to insert new shdr for .init_array", stderr);
+      }
+    }
+
+    if (present.fini_array) {
+      shdr = {};
+      shdr.sh_name = shstrtab.GetOffset(".fini_array");
+      shdr.sh_type = SHT_FINI_ARRAY;
+      shdr.sh_flags = SHF_ALLOC | SHF_WRITE;
+      shdr.sh_addr = dyn_info.fini_array;
+      shdr.sh_offset = vaddr_to_foffset(shdr.sh_addr);
+      shdr.sh_size = dyn_info.fini_arraysz;
+      shdr.sh_addralign = sizeof(u64);
+      if (insert_shdr(shdr, true) == SHN_UNDEF) {
+        fputs("failed to insert new shdr for .fini_array", stderr);
+      }
+    }
+
+    if (present.hash) {
+      struct {
+        u32 nbucket;
+        u32 nchain;
+      }* hash = reinterpret_cast<decltype(hash)>(&image[dyn_info.hash]);
+      shdr = {};
+      shdr.sh_name = shstrtab.GetOffset(".hash");
+      shdr.sh_type = SHT_HASH;
+      shdr.sh_flags = SHF_ALLOC;
+      shdr.sh_addr = dyn_info.hash;
+      shdr.sh_offset = vaddr_to_foffset(shdr.sh_addr);
+      shdr.sh_size = sizeof(*hash) + hash->nbucket * sizeof(u32) +
+                     hash->nchain * sizeof(u32);
+      shdr.sh_link = dynsym_shndx;
+      shdr.sh_addralign = sizeof(u64);
+      shdr.sh_entsize = sizeof(u32);
+      if (insert_shdr(shdr) == SHN_UNDEF) {
+        fputs("failed to insert new shdr for .hash", stderr);
+      }
+    }
+
+    if (present.gnu_hash) {
+      struct {
+        u32 nbuckets;
+        u32 symndx;
+        u32 maskwords;
+        u32 shift2;
+      }* gnu_hash =
+          reinterpret_cast<decltype(gnu_hash)>(&image[dyn_info.gnu_hash]);
+      size_t gnu_hash_len = sizeof(*gnu_hash);
+      gnu_hash_len += gnu_hash->maskwords * sizeof(u64);
+      gnu_hash_len += gnu_hash->nbuckets * sizeof(u32);
+      u64 dynsymcount = header.dynsym.size / sizeof(Elf64_Sym);
+      gnu_hash_len += (dynsymcount - gnu_hash->symndx) * sizeof(u32);
+      shdr = {};
+      shdr.sh_name = shstrtab.GetOffset(".gnu.hash");
+      shdr.sh_type = SHT_GNU_HASH;
+      shdr.sh_flags = SHF_ALLOC;
+      shdr.sh_addr = dyn_info.gnu_hash;
+      shdr.sh_offset = vaddr_to_foffset(shdr.sh_addr);
+      shdr.sh_size = gnu_hash_len;
+      shdr.sh_link = dynsym_shndx;
+      shdr.sh_addralign = sizeof(u64);
+      shdr.sh_entsize = sizeof(u32);
+      if (insert_shdr(shdr) == SHN_UNDEF) {
+        fputs("failed to insert new shdr for .gnu.hash", stderr);
+      }
+    }
+
+    if (present.note) {
+      shdr = {};
+      shdr.sh_name = shstrtab.GetOffset(".note");
+      shdr.sh_type = SHT_NOTE;
+      shdr.sh_flags = SHF_ALLOC;
+      shdr.sh_addr = reinterpret_cast<uintptr_t>(note) -
+                     reinterpret_cast<uintptr_t>(&image[0]);
+      shdr.sh_offset = vaddr_to_foffset(shdr.sh_addr);
+      shdr.sh_size = sizeof(*note) + note->n_descsz + note->n_namesz;
+      shdr.sh_addralign = sizeof(u32);
+      if (insert_shdr(shdr) == SHN_UNDEF) {
+        fputs("failed to insert new shdr for .note", stderr);
+      }
+    }
+
+    if (present.api_info) {
+      shdr = {};
+      shdr.sh_name = shstrtab.GetOffset(".api_info");
+      shdr.sh_type = SHT_PROGBITS;
+      shdr.sh_flags = SHF_ALLOC;
+      shdr.sh_addr =
+          header.segments[kRodata].mem_offset + header.api_info.offset;
+      shdr.sh_offset = vaddr_to_foffset(shdr.sh_addr);
+      shdr.sh_size = header.api_info.size;
+      shdr.sh_addralign = 1;
+      if (insert_shdr(shdr) == SHN_UNDEF) {
+        fputs("failed to insert new shdr for .api_info", stderr);
+      }
+    }
+
+    if (present.eh) {
+      shdr = {};
+      shdr.sh_name = shstrtab.GetOffset(".eh_frame_hdr");
+      shdr.sh_type = SHT_PROGBITS;
+      shdr.sh_flags = SHF_ALLOC;
+      shdr.sh_addr = eh_info.hdr_addr;
+      shdr.sh_offset = vaddr_to_foffset(shdr.sh_addr);
+      shdr.sh_size = eh_info.hdr_size;
+      shdr.sh_addralign = sizeof(u32);
+      if (insert_shdr(shdr, true) == SHN_UNDEF) {
+        fputs("failed to insert new shdr for .eh_frame_hdr", stderr);
+      }
+      shdr = {};
+      shdr.sh_name = shstrtab.GetOffset(".eh_frame");
+      shdr.sh_type = SHT_PROGBITS;
+      shdr.sh_flags = SHF_ALLOC;
+      shdr.sh_addr = eh_info.frame_addr;
+      shdr.sh_offset = vaddr_to_foffset(shdr.sh_addr);
+      shdr.sh_size = eh_info.frame_size;
+      shdr.sh_addralign = sizeof(u32);
+      if (insert_shdr(shdr, true) == SHN_UNDEF) {
+        fputs("failed to insert new shdr for .eh_frame", stderr);
+      }
+    }
+
+    for (size_t i = 0; i < pass_sections.size(); i++) {
+      auto section = pass_sections[i];
+      shdr = {};
+      shdr.sh_name = shstrtab.GetOffset(section->name.c_str());
+      shdr.sh_type = section->type;
+      shdr.sh_flags = section->flags;
+      shdr.sh_addralign = section->addralign;
+      shdr.sh_entsize = section->entsize;
+      if (section->flags & SHF_ALLOC) {
+        shdr.sh_addr = section->addr;
+        shdr.sh_offset = vaddr_to_foffset(shdr.sh_addr);
+        shdr.sh_size = section->size;
+      } else {
+        shdr.sh_offset = pass_section_offsets[i];
+        shdr.sh_size = section->data.size();
+        if (!section->data.empty()) {
+          memcpy(&elf[shdr.sh_offset], section->data.data(), shdr.sh_size);
+        }
+      }
+      if (insert_shdr(shdr, !!(section->flags & SHF_ALLOC)) == SHN_UNDEF) {
+        fprintf(stderr, "failed to insert new shdr for %s\n",
+                section->name.c_str());
+      }
+    }
+
+    if (!symtab.empty()) {
+      shdr = {};
+      shdr.sh_name = shstrtab.GetOffset(".strtab");
+      shdr.sh_type = SHT_STRTAB;
+      shdr.sh_offset = strtab_offset;
+      shdr.sh_size = strtab.buffer.size();
+      shdr.sh_addralign = sizeof(char);
+      memcpy(&elf[shdr.sh_offset], strtab.buffer.data(), shdr.sh_size);
+      u32 strtab_shndx = insert_shdr(shdr);
+      if (strtab_shndx == SHN_UNDEF) {
+        fputs("failed to insert new shdr for .strtab", stderr);
+      }
+
+      shdr = {};
+      shdr.sh_name = shstrtab.GetOffset(".symtab");
+      shdr.sh_type = SHT_SYMTAB;
+      shdr.sh_offset = symtab_offset;
+      shdr.sh_size = symtab.size() * sizeof(Elf64_Sym);
+      shdr.sh_link = strtab_shndx;
+      shdr.sh_info = symtab_num_local;
+      shdr.sh_addralign = sizeof(u64);
+      shdr.sh_entsize = sizeof(Elf64_Sym);
+      memcpy(&elf[shdr.sh_offset], symtab.data(), shdr.sh_size);
+      if (insert_shdr(shdr) == SHN_UNDEF) {
+        fputs("failed to insert new shdr for .symtab", stderr);
+      }
+    }
+
+    shdr = {};
+    shdr.sh_name = shstrtab.GetOffset(".shstrtab");
+    shdr.sh_type = SHT_STRTAB;
+    shdr.sh_offset = shstrtab.offset;
+    shdr.sh_size = shstrtab.buffer.size();
+    shdr.sh_addralign = sizeof(char);
+    ehdr->e_shstrndx = insert_shdr(shdr);
+    if (ehdr->e_shstrndx == SHN_UNDEF) {
+      fputs("failed to insert new shdr for .shstrtab", stderr);
+    }
+  }
+
+  FileType file_type{kUnknown};
+
+  NsoHeader header{};
+
+  std::vector<u8> image;
+  // Set by Load when the module has no build id
+  BLAKE3::Digest image_hash{};
+  bool has_image_hash{};
+  // Cleared by callers which never identify the module, to skip hashing
+  bool hash_image{true};
+  const Elf64_Dyn* dynamic{};
+  const Elf64_Nhdr* note{};
+  std::vector<const Elf64_Sym*> symbols_by_addr;
+
+  struct {
+    u64 symtab;
+    u64 rela;
+    u64 relasz;
+    u64 jmprel;
+    u64 pltrelsz;
+    u64 strtab;
+    u64 strsz;
+    u64 pltgot;
+    u64 hash;
+    u64 gnu_hash;
+    u64 init;
+    u64 fini;
+    u64 init_array;
+    u64 init_arraysz;
+    u64 fini_array;
+    u64 fini_arraysz;
+  } dyn_info{};
+
+  struct {
+    u64 addr;
+    u64 size;
+  } plt_info{};
+
+  struct {
+    u64 hdr_addr;
+    u64 hdr_size;
+    u64 frame_addr;
+    u64 frame_size;
+  } eh_info{};
+};
+inline const std::array<u8, 4> NsoFile::nso_magic{{'N', 'S', 'O', '0'}};
+inline const std::array<u8, 4> NsoFile::nro_magic{{'N', 'R', 'O', '0'}};
+inline const std::array<u8, 4> NsoFile::mod_magic{{'M', 'O', 'D', '0'}};
+inline const std::array<const char*, NsoFile::kNumSegment>
+    NsoFile::segment_names{
+    {".text", ".rodata", ".data"}};
@@ -0,0 +1,137 @@
+/* C interface to nx2elf, for use from other languages via FFI.
+ *
+ * Views returned by the query functions point into the loaded image and
+ * remain valid until nx2elf_close. They are read-only.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(_WIN32)
+#define NX2ELF_API __declspec(dllexport)
+#elif defined(__GNUC__)
+#define NX2ELF_API __attribute__((visibility("default")))
+#else
+#define NX2ELF_API
+#endif
+
+enum {
+  NX2ELF_OK = 0,
+  NX2ELF_ERR_INVALID = -1,
+  NX2ELF_ERR_IO = -2,
+  /* *size has been set to the required size */
+  NX2ELF_ERR_BUFFER_TOO_SMALL = -3,
+  NX2ELF_ERR_NOT_FOUND = -4,
+};
+
+enum nx2elf_file_type {
+  NX2ELF_TYPE_UNKNOWN,
+  NX2ELF_TYPE_NSO,
+  NX2ELF_TYPE_NRO,
+  NX2ELF_TYPE_MOD,
+  NX2ELF_TYPE_ELF,
+};
+
+enum nx2elf_segment_type {
+  NX2ELF_SEGMENT_TEXT,
+  NX2ELF_SEGMENT_RODATA,
+  NX2ELF_SEGMENT_DATA,
+  NX2ELF_NUM_SEGMENTS,
+};
+
+typedef struct nx2elf_file nx2elf_file;
+
+typedef struct nx2elf_view {
+  const void* data;
+  size_t size;
+} nx2elf_view;
+
+/* Array of fixed size entries (Elf64_Sym, Elf64_Rela) */
+typedef struct nx2elf_table {
+  const void* data;
+  size_t count;
+  size_t entsize;
+} nx2elf_table;
+
+typedef struct nx2elf_segment {
+  uint64_t vaddr;
+  uint64_t size;
+  /* Only non-zero for NX2ELF_SEGMENT_DATA */
+  uint64_t bss_size;
+  const void* data;
+} nx2elf_segment;
+
+/* Pointer stored at source, from an R_AARCH64_RELATIVE or ABS64 relocation */
+typedef struct nx2elf_pointer {
+  uint64_t source;
+  uint64_t target;
+} nx2elf_pointer;
+
+/* Input is copied; the caller's buffer may be released after return. */
+NX2ELF_API nx2elf_file* nx2elf_open_memory(const void* data, size_t size);
+/* Reads from the current position of fd until EOF. fd is not closed. */
+NX2ELF_API nx2elf_file* nx2elf_open_fd(int fd);
+NX2ELF_API nx2elf_file* nx2elf_open_path(const char* path);
+NX2ELF_API void nx2elf_close(nx2elf_file* file);
+
+NX2ELF_API int nx2elf_get_type(const nx2elf_file* file);
+/* NSO header; synthesized from the NRO header or MOD for other types. */
+NX2ELF_API int nx2elf_get_header(const nx2elf_file* file, nx2elf_view* header);
+NX2ELF_API int nx2elf_get_build_id(const nx2elf_file* file,
+                                   nx2elf_view* build_id);
+/* Build id, or the BLAKE3 hash of the segments for modules without one. */
+NX2ELF_API int nx2elf_get_module_id(const nx2elf_file* file, nx2elf_view* id);
+/* The image ends with the initialized part of .data; .bss is not stored. */
+NX2ELF_API nx2elf_view nx2elf_get_image(const nx2elf_file* file);
+/* Copies size bytes at vaddr, with .bss reading as zero. */
+NX2ELF_API int nx2elf_read(const nx2elf_file* file,
+                           uint64_t vaddr,
+                           void* out,
+                           size_t size);
+NX2ELF_API int nx2elf_get_segment(const nx2elf_file* file,
+                                  int index,
+                                  nx2elf_segment* segment);
+NX2ELF_API int nx2elf_get_dynsym(const nx2elf_file* file,
+                                 nx2elf_table* symbols);
+NX2ELF_API int nx2elf_get_dynstr(const nx2elf_file* file,
+                                 nx2elf_view* strings);
+NX2ELF_API int nx2elf_get_rela(const nx2elf_file* file,
+                               nx2elf_table* relocations);
+NX2ELF_API int nx2elf_get_jmprel(const nx2elf_file* file,
+                                 nx2elf_table* relocations);
+
+/* Pointers whose target (or source) lies in [start, end), as a table of
+ * nx2elf_pointer sorted by target (or source). The index is built by the
+ * first call, which must not race with other calls on the same file. */
+NX2ELF_API int nx2elf_get_pointers_to(nx2elf_file* file,
+                                      uint64_t start,
+                                      uint64_t end,
+                                      nx2elf_table* pointers);
+NX2ELF_API int nx2elf_get_pointers_from(nx2elf_file* file,
+                                        uint64_t start,
+                                        uint64_t end,
+                                        nx2elf_table* pointers);
+
+/* Runs the default analysis passes; their sections and symbols are included
+ * by later nx2elf_write_elf* calls. jobs == 0 uses all cores. */
+NX2ELF_API int nx2elf_run_passes(nx2elf_file* file, unsigned jobs);
+
+/* Writes the converted ELF into buf. On NX2ELF_ERR_BUFFER_TOO_SMALL, *size
+ * holds the required size; pass buf == NULL to query it. On success *size is
+ * the number of bytes written. */
+NX2ELF_API int nx2elf_write_elf(nx2elf_file* file, void* buf, size_t* size);
+NX2ELF_API int nx2elf_write_elf_fd(nx2elf_file* file, int fd);
+/* Same as above for an NSO with all segments uncompressed. */
+NX2ELF_API int nx2elf_write_uncompressed(nx2elf_file* file,
+                                         void* buf,
+                                         size_t* size);
+NX2ELF_API int nx2elf_write_uncompressed_fd(nx2elf_file* file, int fd);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include "resources.h"
+#include "types.h"
+
+// Runs func(i) for every i in [0, count) on up to |jobs| threads (including
+// the calling one). Indices are handed out one at a time, so uneven work items
+// still balance.
+inline void ParallelFor(size_t count,
+                        unsigned jobs,
+                        const std::function<void(size_t)>& func) {
+  jobs = static_cast<unsigned>(std::min<size_t>(std::max(1u, jobs), count));
+  if (jobs <= 1) {
+    for (size_t i = 0; i < count; i++) {
+      func(i);
+    }
+    return;
+  }
+  std::atomic<size_t> next{0};
+  auto worker = [&]() {
+    for (size_t i; (i = next++) < count;) {
+      func(i);
+    }
+  };
+  std::vector<std::thread> threads;
+  for (unsigned i = 1; i < jobs; i++) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+}
@@ -0,0 +1,24 @@
+#include <memory>
+
+#include "analysis.h"
+#include "pointer_index.h"
+
+namespace {
+
+// Builds the relocation pointer graph and writes it to <output>.ptrs. The
+// PointerIndex is shared with dependent passes.
+class PointerIndexPass : public AnalysisPass {
+ public:
+  const char* Name() const override { return "pointers"; }
+  bool Run(const PassContext& ctx, PassResult* result) override {
+    auto index = std::make_shared<PointerIndex>();
+    index->Build(ctx.view, ctx.jobs);
+    result->artifacts.push_back({".ptrs", index->Serialize()});
+    result->data = index;
+    return true;
+  }
+};
+
+REGISTER_ANALYSIS_PASS(PointerIndexPass);
+
+}  // namespace
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "analysis.h"
+#include "parallel.h"
+#include "types.h"
+
+// Pointer stored at |source| which points to |target|. Layout is shared by
+// the index file and the C API (nx2elf_pointer).
+struct PointerEdge {
+  u64 source;
+  u64 target;
+};
+
+// Exact data reference graph taken from R_AARCH64_RELATIVE and ABS64
+// relocations. The same edges are kept sorted both ways, so "what does this
+// point to" and "who points here" are both binary searches.
+//
+// File layout (little endian), suitable for mmap:
+//   PointerIndexHeader
+//   PointerEdge by_source[count]  sorted by (source, target)
+//   PointerEdge by_target[count]  sorted by (target, source)
+struct PointerIndexHeader {
+  char magic[8];
+  u64 count;
+  u64 reserved[2];
+};
+inline constexpr char pointer_index_magic[8] = {'N', 'X', 'P', 'T',
+                                                'R', 'S', '1', '\0'};
+
+struct PointerIndexView {
+  typedef std::pair<const PointerEdge*, const PointerEdge*> Range;
+
+  // Wraps a serialized index; |data| must stay valid and 8 byte aligned.
+  bool Parse(const void* data, size_t size) {
+    if (size < sizeof(PointerIndexHeader)) {
+      return false;
+    }
+    auto header = static_cast<const PointerIndexHeader*>(data);
+    if (memcmp(header->magic, pointer_index_magic, sizeof(header->magic)) ||
+        header->count > (size - sizeof(*header)) / (2 * sizeof(PointerEdge))) {
+      return false;
+    }
+    count = header->count;
+    by_source = reinterpret_cast<const PointerEdge*>(&header[1]);
+    by_target = by_source + count;
+    return true;
+  }
+  // Edges whose source lies in [start, end), ordered by source
+  Range From(u64 start, u64 end) const {
+    auto key = [](const PointerEdge& edge, u64 addr) {
+      return edge.source < addr;
+    };
+    auto first = std::lower_bound(by_source, by_source + count, start, key);
+    auto last = std::lower_bound(first, by_source + count, end, key);
+    return {first, last};
+  }
+  // Edges whose target lies in [start, end), ordered by target
+  Range To(u64 start, u64 end) const {
+    auto key = [](const PointerEdge& edge, u64 addr) {
+      return edge.target < addr;
+    };
+    auto first = std::lower_bound(by_target, by_target + count, start, key);
+    auto last = std::lower_bound(first, by_target + count, end, key);
+    return {first, last};
+  }
+
+  const PointerEdge* by_source{};
+  const PointerEdge* by_target{};
+  size_t count{};
+};
+
+struct PointerIndex {
+  void Build(const ImageView& view, unsigned jobs) {
+    by_source.clear();
+    for (size_t i = 0; i < view.num_rela; i++) {
+      auto& rela = view.rela[i];
+      u64 target;
+      switch (ELF64_R_TYPE(rela.r_info)) {
+      case R_AARCH64_RELATIVE:
+        target = rela.r_addend;
+        break;
+      case R_AARCH64_ABS64: {
+        // Only pointers into this module; imports have no address yet
+        u32 sym = ELF64_R_SYM(rela.r_info);
+        if (sym >= view.num_dynsym || view.dynsym[sym].st_shndx == SHN_UNDEF) {
+          continue;
+        }
+        target = view.dynsym[sym].st_value + rela.r_addend;
+        break;
+      }
+      default:
+        continue;
+      }
+      by_source.push_back({rela.r_offset, target});
+    }
+    by_target = by_source;
+    ParallelFor(2, jobs, [this](size_t i) {
+      if (i == 0) {
+        std::sort(by_source.begin(), by_source.end(),
+                  [](const PointerEdge& a, const PointerEdge& b) {
+                    return a.source != b.source ? a.source < b.source
+                                                : a.target < b.target;
+                  });
+      } else {
+        std::sort(by_target.begin(), by_target.end(),
+                  [](const PointerEdge& a, const PointerEdge& b) {
+                    return a.target != b.target ? a.target < b.target
+                                                : a.source < b.source;
+                  });
+      }
+    });
+  }
+  PointerIndexView View() const {
+    return {by_source.data(), by_target.data(), by_source.size()};
+  }
+  std::vector<u8> Serialize() const {
+    PointerIndexHeader header{};
+    memcpy(header.magic, pointer_index_magic, sizeof(header.magic));
+    header.count = by_source.size();
+    size_t edges_size = by_source.size() * sizeof(PointerEdge);
+    std::vector<u8> out(sizeof(header) + 2 * edges_size);
+    memcpy(&out[0], &header, sizeof(header));
+    if (edges_size) {
+      memcpy(&out[sizeof(header)], by_source.data(), edges_size);
+      memcpy(&out[sizeof(header) + edges_size], by_target.data(), edges_size);
+    }
+    return out;
+  }
+
+  std::vector<PointerEdge> by_source;
+  std::vector<PointerEdge> by_target;
+};
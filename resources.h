@@ -0,0 +1,144 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "types.h"
+
+#ifdef __linux__
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+// Limits of the cgroup (v2) the process runs in. 0 means unlimited.
+struct CgroupLimits {
+  double cpus;
+  u64 memory;
+};
+
+inline CgroupLimits ReadCgroupLimits() {
+  CgroupLimits limits{};
+#ifdef __linux__
+  auto read_line = [](const std::string& path) -> std::string {
+    char line[256]{};
+    FILE* f = fopen(path.c_str(), "r");
+    if (!f) {
+      return {};
+    }
+    if (!fgets(line, sizeof(line), f)) {
+      line[0] = '\0';
+    }
+    fclose(f);
+    return line;
+  };
+  // The v2 hierarchy is the "0::<path>" entry
+  std::string cgroup;
+  if (FILE* f = fopen("/proc/self/cgroup", "r")) {
+    char line[4096];
+    while (fgets(line, sizeof(line), f)) {
+      if (!strncmp(line, "0::", 3)) {
+        cgroup = line + 3;
+        cgroup.erase(cgroup.find_last_not_of("\n") + 1);
+      }
+    }
+    fclose(f);
+  }
+  if (cgroup.empty()) {
+    return limits;
+  }
+  // Limits of every ancestor apply, so take the tightest one.
+  const std::string root = "/sys/fs/cgroup";
+  for (std::string dir = cgroup;;) {
+    auto base = root + (dir == "/" ? "" : dir);
+    auto cpu_max = read_line(base + "/cpu.max");
+    double quota, period;
+    if (sscanf(cpu_max.c_str(), "%lf %lf", &quota, &period) == 2 &&
+        period > 0) {
+      double cpus = quota / period;
+      limits.cpus = limits.cpus ? std::min(limits.cpus, cpus) : cpus;
+    }
+    auto memory_max = read_line(base + "/memory.max");
+    if (!memory_max.empty() && isdigit(memory_max[0])) {
+      u64 memory = strtoull(memory_max.c_str(), nullptr, 10);
+      limits.memory = limits.memory ? std::min(limits.memory, memory) : memory;
+    }
+    if (dir == "/" || dir.empty()) {
+      break;
+    }
+    auto slash = dir.find_last_of('/');
+    dir = slash == 0 ? "/" : dir.substr(0, slash);
+  }
+#endif
+  return limits;
+}
+
+inline const CgroupLimits& GetCgroupLimits() {
+  static const CgroupLimits limits = ReadCgroupLimits();
+  return limits;
+}
+
+// Worker count which neither exceeds the CPUs we may be scheduled on nor the
+// cgroup CPU quota (rounded up, so a 1.5 CPU quota still uses 2 workers).
+inline unsigned DefaultJobs() {
+  unsigned jobs = std::max(1u, std::thread::hardware_concurrency());
+#ifdef __linux__
+  cpu_set_t set;
+  if (!sched_getaffinity(0, sizeof(set), &set)) {
+    jobs = std::max(1, CPU_COUNT(&set));
+  }
+#endif
+  auto cpus = GetCgroupLimits().cpus;
+  if (cpus > 0) {
+    jobs = std::min(jobs, std::max(1u, static_cast<unsigned>(std::ceil(cpus))));
+  }
+  return jobs;
+}
+
+// Bytes of conversion state (input, image and output buffers) which may be in
+// flight at once: half of the cgroup memory limit, or of physical memory.
+// Leaves room for the allocator and everything else in the process.
+inline u64 DefaultMemoryBudget() {
+  u64 memory = GetCgroupLimits().memory;
+#ifdef __linux__
+  long pages = sysconf(_SC_PHYS_PAGES);
+  long page_size = sysconf(_SC_PAGE_SIZE);
+  if (pages > 0 && page_size > 0) {
+    u64 physical = static_cast<u64>(pages) * page_size;
+    memory = memory ? std::min(memory, physical) : physical;
+  }
+#endif
+  return memory / 2;
+}
+
+// Admission control for memory in use by concurrent conversions.
+struct MemoryBudget {
+  explicit MemoryBudget(u64 limit) : limit(limit) {}
+  // Blocks until |bytes| fit in the budget. A request larger than the whole
+  // budget is admitted once nothing else is in flight. 0 disables the limit.
+  void Acquire(u64 bytes) {
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [&] {
+      return !limit || in_flight == 0 || in_flight + bytes <= limit;
+    });
+    in_flight += bytes;
+  }
+  void Release(u64 bytes) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      in_flight -= bytes;
+    }
+    cv.notify_all();
+  }
+
+  u64 limit;
+  u64 in_flight{};
+  std::mutex mutex;
+  std::condition_variable cv;
+};
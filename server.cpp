@@ -0,0 +1,276 @@
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "json.h"
+#include "server.h"
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+enum JobClass { kInteractive, kBulk, kNumClasses };
+const char* const class_names[kNumClasses] = {"interactive", "bulk"};
+
+struct Job {
+  Job(u64 id,
+      JobClass job_class,
+      const std::string& input,
+      const std::string& elf_path,
+      const std::string& analysis_path,
+      const ConvertOptions& options)
+      : id(id),
+        job_class(job_class),
+        elf_path(elf_path),
+        analysis_path(analysis_path),
+        conversion(input, options),
+        arrival(Clock::now()) {
+    auto c_str = [](const std::string& str) {
+      return str.empty() ? nullptr : str.c_str();
+    };
+    conversion.options.elf_path = c_str(this->elf_path);
+    conversion.options.analysis_path = c_str(this->analysis_path);
+    conversion.options.uncompressed_path = nullptr;
+  }
+
+  u64 id;
+  JobClass job_class;
+  std::string elf_path;
+  std::string analysis_path;
+  Conversion conversion;
+  Clock::time_point arrival;
+  Clock::time_point start;
+  unsigned preemptions{};
+  bool ok{true};
+};
+
+class Server {
+ public:
+  Server(FILE* out, const ServeOptions& options)
+      : out_(out),
+        options_(options),
+        max_bulk_(options.workers -
+                  std::min(options.reserved, options.workers - 1)) {
+    if (options.cache_budget) {
+      cache_ = std::make_unique<ModuleCache>(options.cache_budget);
+    }
+  }
+
+  void Run(FILE* in) {
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < options_.workers; i++) {
+      threads.emplace_back([this] { Work(); });
+    }
+    char line[4096];
+    while (fgets(line, sizeof(line), in)) {
+      Handle(line);
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      closing_ = true;
+    }
+    cv_.notify_all();
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    PrintStats();
+  }
+
+ private:
+  void Handle(const std::string& line) {
+    std::istringstream fields(line);
+    std::string command, input, elf_path, analysis_path;
+    fields >> command >> input >> elf_path >> analysis_path;
+    if (command.empty()) {
+      return;
+    }
+    if (command == "stats") {
+      PrintStats();
+      return;
+    }
+    JobClass job_class = kNumClasses;
+    for (int i = 0; i < kNumClasses; i++) {
+      if (command == class_names[i]) {
+        job_class = static_cast<JobClass>(i);
+      }
+    }
+    if (job_class == kNumClasses || input.empty()) {
+      Print("{\"error\":\"bad request\",\"request\":" +
+            JsonString(command.c_str()) + "}");
+      return;
+    }
+    auto options = options_.convert;
+    options.jobs = 1;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      queues_[job_class].push_back(std::make_unique<Job>(
+          next_id_++, job_class, input, elf_path, analysis_path, options));
+      queues_[job_class].back()->conversion.cache = cache_.get();
+    }
+    cv_.notify_one();
+  }
+
+  // Interactive jobs go first. Bulk jobs only run on unreserved workers.
+  std::unique_ptr<Job> Take() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    idle_++;
+    for (;;) {
+      std::unique_ptr<Job> job;
+      if (!queues_[kInteractive].empty()) {
+        job = std::move(queues_[kInteractive].front());
+        queues_[kInteractive].pop_front();
+      } else if (!queues_[kBulk].empty() && bulk_running_ < max_bulk_) {
+        job = std::move(queues_[kBulk].front());
+        queues_[kBulk].pop_front();
+        bulk_running_++;
+      } else if (closing_ && queues_[kInteractive].empty() &&
+                 queues_[kBulk].empty()) {
+        idle_--;
+        return nullptr;
+      }
+      if (job) {
+        idle_--;
+        return job;
+      }
+      cv_.wait(lock);
+    }
+  }
+
+  // A bulk job gives up its worker if an interactive job waits and no worker
+  // is idle to take it. Its state is kept and it resumes at the next phase.
+  bool Preempt(std::unique_ptr<Job>& job) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (queues_[kInteractive].empty() || idle_) {
+      return false;
+    }
+    job->preemptions++;
+    bulk_running_--;
+    queues_[kBulk].push_front(std::move(job));
+    return true;
+  }
+
+  void Work() {
+    while (auto job = Take()) {
+      if (job->conversion.phase == Conversion::kLoad) {
+        job->start = Clock::now();
+      }
+      bool preempted = false;
+      while (job->ok && job->conversion.phase != Conversion::kDone) {
+        job->ok = job->conversion.RunPhase();
+        if (job->job_class == kBulk && job->ok &&
+            job->conversion.phase != Conversion::kDone && Preempt(job)) {
+          preempted = true;
+          break;
+        }
+      }
+      if (preempted) {
+        // Let the waiting interactive job have this worker
+        cv_.notify_all();
+        continue;
+      }
+      Finish(*job);
+      if (job->job_class == kBulk) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        bulk_running_--;
+      }
+      cv_.notify_all();
+    }
+  }
+
+  void Finish(const Job& job) {
+    auto now = Clock::now();
+    auto ms = [](Clock::duration d) {
+      return std::chrono::duration<double, std::milli>(d).count();
+    };
+    double latency = ms(now - job.arrival);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      latencies_[job.job_class].push_back(latency);
+    }
+    char buf[192];
+    snprintf(buf, sizeof(buf),
+             ",\"ok\":%s,\"cached\":%s,\"queued_ms\":%.3f,"
+             "\"latency_ms\":%.3f,\"preemptions\":%u}",
+             job.ok ? "true" : "false",
+             job.conversion.cached ? "true" : "false",
+             ms(job.start - job.arrival), latency, job.preemptions);
+    Print("{\"id\":" + std::to_string(job.id) + ",\"class\":\"" +
+          class_names[job.job_class] + "\",\"input\":" +
+          JsonString(job.conversion.path.string().c_str()) + buf);
+  }
+
+  void PrintStats() {
+    std::string line("{\"stats\":{");
+    for (int i = 0; i < kNumClasses; i++) {
+      std::vector<double> sorted;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        sorted = latencies_[i];
+      }
+      std::sort(sorted.begin(), sorted.end());
+      // Nearest rank
+      auto percentile = [&sorted](double p) {
+        if (sorted.empty()) {
+          return 0.0;
+        }
+        size_t rank = static_cast<size_t>(p / 100 * sorted.size() + 0.999999);
+        return sorted[std::min(std::max<size_t>(rank, 1), sorted.size()) - 1];
+      };
+      char buf[256];
+      snprintf(buf, sizeof(buf),
+               "%s\"%s\":{\"count\":%zu,\"p50_ms\":%.3f,\"p90_ms\":%.3f,"
+               "\"p99_ms\":%.3f,\"max_ms\":%.3f}",
+               i ? "," : "", class_names[i], sorted.size(), percentile(50),
+               percentile(90), percentile(99), percentile(100));
+      line += buf;
+    }
+    if (cache_) {
+      auto stats = cache_->GetStats();
+      char buf[160];
+      snprintf(buf, sizeof(buf),
+               ",\"cache\":{\"hits\":%" PRIu64 ",\"misses\":%" PRIu64
+               ",\"entries\":%" PRIu64 ",\"bytes\":%" PRIu64 "}",
+               stats.hits, stats.misses, stats.entries, stats.bytes);
+      line += buf;
+    }
+    Print(line + "}}");
+  }
+
+  void Print(const std::string& line) {
+    std::lock_guard<std::mutex> lock(out_mutex_);
+    fprintf(out_, "%s\n", line.c_str());
+    fflush(out_);
+  }
+
+  FILE* out_;
+  ServeOptions options_;
+  unsigned max_bulk_;
+  std::unique_ptr<ModuleCache> cache_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<std::unique_ptr<Job>> queues_[kNumClasses];
+  std::vector<double> latencies_[kNumClasses];
+  unsigned bulk_running_{};
+  unsigned idle_{};
+  bool closing_{};
+  u64 next_id_{};
+
+  std::mutex out_mutex_;
+};
+
+}  // namespace
+
+int Serve(FILE* in, FILE* out, const ServeOptions& options) {
+  ServeOptions checked = options;
+  checked.workers = std::max(1u, options.workers);
+  Server(out, checked).Run(in);
+  return 0;
+}
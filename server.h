@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstdio>
+
+#include "conversion.h"
+
+struct ServeOptions {
+  // Template for every request; paths come from the request
+  ConvertOptions convert;
+  unsigned workers;
+  // Workers which never run bulk jobs, so interactive jobs start promptly
+  unsigned reserved;
+  // Bytes of recently converted modules kept in memory; 0 disables the cache
+  u64 cache_budget;
+};
+
+// Conversion service reading one request per line from |in|:
+//   interactive|bulk <input> [<elf output> [<analysis prefix>]]
+//   stats
+// Interactive jobs are queued ahead of bulk ones, and a bulk job yields its
+// worker between phases (load, analyze, write) while interactive jobs wait.
+// Modules are cached by content (see ModuleCache), so repeated requests skip
+// reading, decompression and analysis.
+// Writes one JSON line per finished job to |out|, and latency percentiles
+// per class and cache counters for "stats" and at the end of input.
+int Serve(FILE* in, FILE* out, const ServeOptions& options);
@@ -0,0 +1,311 @@
+#include <algorithm>
+#include <iterator>
+
+#include "parallel.h"
+#include "sjis_table.h"
+#include "string_scan.h"
+
+namespace {
+
+// Bytes which may be part of a byte string
+bool IsRunByte(u8 b) {
+  return b >= 0x20 ? b != 0x7f : b == '\t' || b == '\n' || b == '\r';
+}
+
+// Excludes control characters, surrogates, private use and noncharacters
+bool IsPrintable(u32 c) {
+  if (c < 0xa0) {
+    return c >= 0x20 ? c != 0x7f : c == '\t' || c == '\n' || c == '\r';
+  }
+  return (c < 0xd800 || c >= 0xf900) && (c & 0xfffe) != 0xfffe &&
+         c < 0xf0000;
+}
+
+void AppendUtf8(u32 c, std::string* out) {
+  if (c < 0x80) {
+    *out += static_cast<char>(c);
+  } else if (c < 0x800) {
+    *out += static_cast<char>(0xc0 | c >> 6);
+    *out += static_cast<char>(0x80 | (c & 0x3f));
+  } else if (c < 0x10000) {
+    *out += static_cast<char>(0xe0 | c >> 12);
+    *out += static_cast<char>(0x80 | (c >> 6 & 0x3f));
+    *out += static_cast<char>(0x80 | (c & 0x3f));
+  } else {
+    *out += static_cast<char>(0xf0 | c >> 18);
+    *out += static_cast<char>(0x80 | (c >> 12 & 0x3f));
+    *out += static_cast<char>(0x80 | (c >> 6 & 0x3f));
+    *out += static_cast<char>(0x80 | (c & 0x3f));
+  }
+}
+
+bool DecodeUtf8(const u8* p, size_t len, size_t* chars) {
+  *chars = 0;
+  for (size_t i = 0; i < len; (*chars)++) {
+    u8 b = p[i];
+    int extra = b < 0x80   ? 0
+                : b < 0xc2 ? -1
+                : b < 0xe0 ? 1
+                : b < 0xf0 ? 2
+                : b < 0xf5 ? 3
+                           : -1;
+    if (extra < 0 || extra >= static_cast<int>(len - i)) {
+      return false;
+    }
+    u32 c = extra ? b & (0x3f >> extra) : b;
+    for (int k = 1; k <= extra; k++) {
+      if ((p[i + k] & 0xc0) != 0x80) {
+        return false;
+      }
+      c = c << 6 | (p[i + k] & 0x3f);
+    }
+    // Overlong forms and code points past U+10FFFF
+    static const u32 min_value[4] = {0, 0x80, 0x800, 0x10000};
+    if (c < min_value[extra] || c > 0x10ffff || !IsPrintable(c)) {
+      return false;
+    }
+    i += extra + 1;
+  }
+  return true;
+}
+
+bool DecodeShiftJis(const u8* p,
+                    size_t len,
+                    std::string* text,
+                    size_t* chars) {
+  text->clear();
+  *chars = 0;
+  size_t half_width = 0, double_byte = 0;
+  for (size_t i = 0; i < len; (*chars)++) {
+    u8 b = p[i++];
+    u32 c;
+    if (b < 0x80) {
+      c = b;
+    } else if (b >= 0xa1 && b <= 0xdf) {
+      // Half-width katakana
+      c = 0xff61 + b - 0xa1;
+      half_width++;
+    } else if (i < len && ((b >= 0x81 && b <= 0x9f) || b >= 0xe0) &&
+               b != 0x87 && b < 0xed && p[i] >= 0x40 && p[i] <= 0xfc &&
+               p[i] != 0x7f) {
+      // JIS X 0208 only; the NEC and IBM extensions are rare in text
+      int lead = b <= 0x9f ? b - 0x81 : b - 0xe0 + 0x1f;
+      int trail = p[i] < 0x7f ? p[i] - 0x40 : p[i] - 0x41;
+      c = sjis_table[lead * sjis_trail_count + trail];
+      double_byte++;
+      i++;
+    } else {
+      return false;
+    }
+    if (!c || !IsPrintable(c)) {
+      return false;
+    }
+    AppendUtf8(c, text);
+  }
+  // Stray multibyte characters are mostly binary data. Text is largely
+  // double byte, or for old style text, half-width katakana.
+  return 2 * double_byte >= *chars || 4 * half_width >= 3 * *chars;
+}
+
+void Emit(const u8* data,
+          u64 start,
+          u64 end,
+          StringEncoding encoding,
+          std::string text,
+          std::vector<FoundString>* out) {
+  if (text.empty()) {
+    text.assign(reinterpret_cast<const char*>(&data[start]), end - start);
+  }
+  out->push_back({start, end - start, encoding, std::move(text)});
+}
+
+// Classifies the byte run [start, end)
+void ByteRun(const u8* data,
+             u64 start,
+             u64 end,
+             size_t min_chars,
+             std::vector<FoundString>* out) {
+  const u8* p = &data[start];
+  size_t len = end - start;
+  if (std::all_of(p, p + len, [](u8 b) { return b < 0x80; })) {
+    if (len >= min_chars) {
+      Emit(data, start, end, kAscii, {}, out);
+    }
+    return;
+  }
+  size_t chars;
+  std::string text;
+  if (DecodeUtf8(p, len, &chars)) {
+    if (chars >= min_chars) {
+      Emit(data, start, end, kUtf8, {}, out);
+    }
+  } else if (DecodeShiftJis(p, len, &text, &chars)) {
+    if (chars >= min_chars) {
+      Emit(data, start, end, kShiftJis, std::move(text), out);
+    }
+  } else {
+    for (u64 i = start; i < end;) {
+      u64 first = i;
+      while (i < end && data[i] < 0x80) {
+        i++;
+      }
+      if (i - first >= min_chars) {
+        Emit(data, first, i, kAscii, {}, out);
+      }
+      while (i < end && data[i] >= 0x80) {
+        i++;
+      }
+    }
+  }
+}
+
+void ScanBytes(const u8* data,
+               u64 begin,
+               u64 end,
+               size_t min_chars,
+               std::vector<FoundString>* out) {
+  for (u64 i = begin; i < end;) {
+    if (!IsRunByte(data[i])) {
+      i++;
+      continue;
+    }
+    u64 start = i;
+    while (i < end && IsRunByte(data[i])) {
+      i++;
+    }
+    ByteRun(data, start, i, min_chars, out);
+  }
+}
+
+// UTF-16 text of games is in a few blocks; restricting units to them keeps
+// byte data read as UTF-16 from passing as CJK text.
+bool IsUtf16TextUnit(u32 c) {
+  return c < 0x100     ? IsPrintable(c)
+         : c < 0x2000  ? false
+         : c < 0x2070  ? true
+         : c < 0x3000  ? false
+         : c < 0x3100  ? true
+         : c < 0x4e00  ? false
+         : c < 0xa000  ? true
+         : c >= 0xff00 && c < 0xfff0;
+}
+
+// Both bytes printable ASCII; such units are what byte strings decode to.
+// Kana and CJK punctuation would need a '0' every other byte and pass.
+bool IsAsciiPair(const u8* p) {
+  return p[0] >= 0x20 && p[0] < 0x7f && p[1] >= 0x20 && p[1] < 0x7f &&
+         p[1] != 0x30;
+}
+
+// Scans the units starting at offsets of |parity| in [begin, end)
+void ScanUtf16(const u8* data,
+               u64 size,
+               u64 begin,
+               u64 end,
+               int parity,
+               size_t min_chars,
+               std::vector<FoundString>* out) {
+  u64 first = begin + ((begin & 1) != u64(parity));
+  u64 start = first;
+  std::string text;
+  // Ideographs are also what most pairs of ASCII bytes decode to, and other
+  // Latin-1 characters what most bytes next to a zero do, so ASCII, kana,
+  // CJK punctuation and full width characters must outnumber the others
+  // and the ASCII pairs together. Runs neither start nor end with a pair.
+  size_t chars = 0, strong = 0, pairs = 0;
+  // The run up to its last unit which is not an ASCII pair
+  u64 kept_end = start;
+  size_t kept_text = 0, kept_chars = 0, kept_strong = 0, kept_pairs = 0;
+  auto flush = [&]() {
+    if (kept_chars >= min_chars &&
+        2 * kept_strong >= kept_chars + kept_pairs) {
+      text.resize(kept_text);
+      Emit(data, start, kept_end, kUtf16le, std::move(text), out);
+    }
+    text.clear();
+    chars = strong = pairs = 0;
+    kept_text = kept_chars = kept_strong = kept_pairs = 0;
+  };
+  for (u64 i = first; i < end && i + 1 < size; i += 2) {
+    u32 c = data[i] | data[i + 1] << 8;
+    bool pair = IsAsciiPair(&data[i]);
+    // Misaligned text is only expected right after a NUL terminated string
+    bool misaligned_start = parity && !chars && data[i - 1];
+    if (!IsUtf16TextUnit(c) || misaligned_start || (pair && !chars)) {
+      flush();
+      start = i + 2;
+      continue;
+    }
+    AppendUtf8(c, &text);
+    chars++;
+    strong += c < 0x7f || (c >= 0x3000 && c < 0x3100) || c >= 0xff00;
+    pairs += pair;
+    if (!pair) {
+      kept_end = i + 2;
+      kept_text = text.size();
+      kept_chars = chars;
+      kept_strong = strong;
+      kept_pairs = pairs;
+    }
+  }
+  flush();
+}
+
+}  // namespace
+
+std::vector<FoundString> ScanStrings(const u8* data,
+                                     size_t size,
+                                     size_t min_chars,
+                                     unsigned jobs) {
+  min_chars = std::max<size_t>(min_chars, 1);
+  const size_t chunk_size = 1 << 20;
+  std::vector<u64> bounds{0};
+  // Three zero bytes at an even offset end strings of every encoding and
+  // both UTF-16 alignments.
+  for (u64 pos = chunk_size; pos < size; pos += chunk_size) {
+    pos = std::max(pos, bounds.back());
+    while (pos + 2 < size && (data[pos] || data[pos + 1] || data[pos + 2])) {
+      pos += 2;
+    }
+    if (pos + 2 >= size) {
+      break;
+    }
+    bounds.push_back(pos + 2);
+  }
+  bounds.push_back(size);
+
+  std::vector<std::vector<FoundString>> found(bounds.size() - 1);
+  ParallelFor(found.size(), jobs, [&](size_t c) {
+    auto& chunk = found[c];
+    ScanBytes(data, bounds[c], bounds[c + 1], min_chars, &chunk);
+    for (int parity = 0; parity < 2; parity++) {
+      ScanUtf16(data, size, bounds[c], bounds[c + 1], parity, min_chars,
+                &chunk);
+    }
+    std::stable_sort(chunk.begin(), chunk.end(),
+                     [](const FoundString& a, const FoundString& b) {
+                       return a.offset < b.offset;
+                     });
+    // The two UTF-16 alignments and the byte scan can read the same bytes;
+    // of overlapping strings the longest is kept.
+    size_t kept = 0;
+    for (auto& s : chunk) {
+      if (kept && s.offset < chunk[kept - 1].offset + chunk[kept - 1].size) {
+        if (s.size > chunk[kept - 1].size) {
+          chunk[kept - 1] = std::move(s);
+        }
+        continue;
+      }
+      if (&s != &chunk[kept]) {
+        chunk[kept] = std::move(s);
+      }
+      kept++;
+    }
+    chunk.resize(kept);
+  });
+  std::vector<FoundString> strings;
+  for (auto& chunk : found) {
+    std::move(chunk.begin(), chunk.end(), std::back_inserter(strings));
+  }
+  return strings;
+}
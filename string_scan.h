@@ -0,0 +1,34 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "types.h"
+
+enum StringEncoding { kAscii, kUtf8, kUtf16le, kShiftJis, kNumEncodings };
+inline constexpr const char* string_encoding_names[kNumEncodings] = {
+    "ascii", "utf-8", "utf-16le", "shift-jis"};
+
+struct FoundString {
+  // Offset into the scanned buffer
+  u64 offset;
+  u64 size;
+  StringEncoding encoding;
+  // Converted to UTF-8
+  std::string text;
+};
+
+// Finds strings of at least |min_chars| characters in |data|, in offset
+// order. Byte strings are runs of printable bytes, reported as ASCII, UTF-8
+// or Shift-JIS in that order of preference, or split into their ASCII parts
+// if they are neither. UTF-16LE strings are looked for at both alignments,
+// restricted to Latin, punctuation, kana, CJK and full width characters.
+// Of strings that overlap, only the longest is reported.
+//
+// The buffer is split into chunks at runs of three zero bytes, where every
+// decoder is between strings, and chunks are scanned on up to |jobs| threads.
+// The result does not depend on |jobs|.
+std::vector<FoundString> ScanStrings(const u8* data,
+                                     size_t size,
+                                     size_t min_chars,
+                                     unsigned jobs);
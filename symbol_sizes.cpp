@@ -0,0 +1,108 @@
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "analysis.h"
+#include "elf_eh.h"
+#include "types.h"
+
+namespace {
+
+// Gives zero-sized .dynsym entries the size of their FDE (for functions), or
+// the distance to the next symbol, table or the end of their section: .data
+// and .bss count apart, so only objects in .bss run to its end.
+class SymbolSizesPass : public AnalysisPass {
+ public:
+  const char* Name() const override { return "symbol_sizes"; }
+  std::vector<std::string> Dependencies() const override {
+    return {"eh_frame"};
+  }
+  bool Run(const PassContext& ctx, PassResult* result) override {
+    auto& view = ctx.view;
+    struct Entry {
+      u64 addr;
+      u32 index;
+    };
+    std::vector<Entry> entries;
+    for (size_t i = 1; i < view.num_dynsym; i++) {
+      auto& sym = view.dynsym[i];
+      u8 type = ELF64_ST_TYPE(sym.st_info);
+      if (sym.st_shndx == SHN_UNDEF || sym.st_shndx == SHN_ABS ||
+          (type != STT_NOTYPE && type != STT_OBJECT && type != STT_FUNC)) {
+        continue;
+      }
+      entries.push_back({sym.st_value, static_cast<u32>(i)});
+    }
+    std::sort(entries.begin(), entries.end(),
+              [](const Entry& a, const Entry& b) { return a.addr < b.addr; });
+
+    auto eh_frame = ctx.Find("eh_frame");
+    if (!eh_frame) {
+      return false;
+    }
+    auto& fdes = *std::static_pointer_cast<const EhFdes>(eh_frame->data);
+
+    // Tables the loader or unwinder reads, which no symbol runs into
+    auto addr_of = [&view](const void* ptr) -> u64 {
+      return ptr ? static_cast<const u8*>(ptr) - view.image : 0;
+    };
+    const u64 tables[] = {view.plt_addr,
+                          view.eh_frame_hdr_addr,
+                          EhFrameAddr(view),
+                          addr_of(view.dynamic),
+                          addr_of(view.dynsym),
+                          addr_of(view.dynstr),
+                          addr_of(view.rela),
+                          addr_of(view.jmprel),
+                          view.hash_addr,
+                          view.gnu_hash_addr,
+                          view.api_info_addr};
+
+    // Single sweep over symbols and FDEs, both sorted by address
+    size_t fde = 0;
+    size_t next = 0;
+    for (auto& entry : entries) {
+      auto& sym = view.dynsym[entry.index];
+      while (next < entries.size() && entries[next].addr <= entry.addr) {
+        next++;
+      }
+      while (fde < fdes.size() && fdes[fde].pc_begin < entry.addr) {
+        fde++;
+      }
+      if (sym.st_size) {
+        continue;
+      }
+      int seg_index = view.SegmentOf(entry.addr);
+      if (seg_index == ImageView::kNumSegment) {
+        continue;
+      }
+      auto& seg = view.segments[seg_index];
+      u64 end = seg.addr + seg.size;
+      if (entry.addr >= end) {
+        end += seg.bss_size;
+      }
+      if (next < entries.size()) {
+        end = std::min(end, entries[next].addr);
+      }
+      for (u64 start : tables) {
+        if (start > entry.addr && start < end) {
+          end = start;
+        }
+      }
+      if (ELF64_ST_TYPE(sym.st_info) == STT_FUNC && fde < fdes.size() &&
+          fdes[fde].pc_begin == entry.addr &&
+          fdes[fde].pc_end > entry.addr) {
+        end = fdes[fde].pc_end;
+      }
+      if (end > entry.addr) {
+        result->dynsym_sizes.push_back({entry.index, end - entry.addr});
+      }
+    }
+    return true;
+  }
+};
+
+REGISTER_ANALYSIS_PASS(SymbolSizesPass);
+
+}  // namespace
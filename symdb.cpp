@@ -0,0 +1,189 @@
+#include <map>
+#include <queue>
+#include <string>
+#include <vector>
+
+#include "nso.h"
+#include "parallel.h"
+#include "symdb.h"
+
+namespace {
+
+struct SymbolEntry {
+  std::string name;
+  SymbolPosting posting;
+};
+// One module's names, sorted
+typedef std::vector<SymbolEntry> SymbolRun;
+
+bool Extract(const fs::path& path, u32 module, SymbolRun* run) {
+  NsoFile nso;
+  if (!nso.Load(path)) {
+    return false;
+  }
+  auto view = nso.GetView();
+  for (size_t i = 1; i < view.num_dynsym; i++) {
+    auto& sym = view.dynsym[i];
+    const char* name = view.SymbolName(sym);
+    if (!*name) {
+      continue;
+    }
+    bool import = sym.st_shndx == SHN_UNDEF;
+    run->push_back(
+        {name,
+         {import ? 0 : sym.st_value, module, import, sym.st_info, 0}});
+  }
+  std::sort(run->begin(), run->end(),
+            [](const SymbolEntry& a, const SymbolEntry& b) {
+              return a.name != b.name
+                         ? a.name < b.name
+                         : a.posting.address < b.posting.address;
+            });
+  return true;
+}
+
+void PutUleb(u64 val, std::vector<u8>* out) {
+  do {
+    u8 b = val & 0x7f;
+    val >>= 7;
+    out->push_back(val ? b | 0x80 : b);
+  } while (val);
+}
+
+template <typename T>
+void Append(const std::vector<T>& data, std::vector<u8>* out) {
+  auto bytes = reinterpret_cast<const u8*>(data.data());
+  out->insert(out->end(), bytes, bytes + data.size() * sizeof(T));
+  out->resize(ALIGN_UP(out->size(), 8));
+}
+
+}  // namespace
+
+bool BuildSymbolDb(const fs::path& root,
+                   unsigned jobs,
+                   std::vector<u8>* out) {
+  struct Module {
+    fs::path path;
+    std::string title;
+  };
+  std::vector<Module> inputs;
+  std::error_code error;
+  for (auto it = fs::recursive_directory_iterator(root, error);
+       it != fs::recursive_directory_iterator(); it.increment(error)) {
+    if (error) {
+      break;
+    }
+    if (!it->is_directory(error)) {
+      auto title = it->path().parent_path().lexically_relative(root);
+      inputs.push_back(
+          {it->path(), title == "." ? "" : title.generic_string()});
+    }
+  }
+  if (error) {
+    fprintf(stderr, "failed to list %s: %s\n", root.string().c_str(),
+            error.message().c_str());
+    return false;
+  }
+  std::sort(inputs.begin(), inputs.end(),
+            [](const Module& a, const Module& b) { return a.path < b.path; });
+
+  // Title and module names, deduplicated
+  std::vector<char> strings;
+  std::map<std::string, u32> string_offsets;
+  auto add_string = [&](const std::string& str) {
+    auto it = string_offsets.find(str);
+    if (it != string_offsets.end()) {
+      return it->second;
+    }
+    u32 offset = static_cast<u32>(strings.size());
+    strings.insert(strings.end(), str.c_str(), str.c_str() + str.size() + 1);
+    string_offsets.emplace(str, offset);
+    return offset;
+  };
+  std::vector<SymbolDbModule> modules;
+  for (auto& input : inputs) {
+    modules.push_back({add_string(input.title),
+                       add_string(input.path.filename().string())});
+  }
+
+  std::vector<SymbolRun> runs(inputs.size());
+  ParallelFor(inputs.size(), jobs, [&](size_t i) {
+    if (!Extract(inputs[i].path, static_cast<u32>(i), &runs[i])) {
+      fprintf(stderr, "skipping %s\n", inputs[i].path.string().c_str());
+    }
+  });
+
+  // K-way merge; ties between runs go to the lower module index
+  typedef std::pair<size_t, size_t> Cursor;
+  auto later = [&runs](const Cursor& a, const Cursor& b) {
+    auto& x = runs[a.first][a.second].name;
+    auto& y = runs[b.first][b.second].name;
+    return x != y ? x > y : a.first > b.first;
+  };
+  std::priority_queue<Cursor, std::vector<Cursor>, decltype(later)> heap(
+      later);
+  for (size_t i = 0; i < runs.size(); i++) {
+    if (!runs[i].empty()) {
+      heap.push({i, 0});
+    }
+  }
+  std::vector<u32> blocks;
+  std::vector<u32> ranges;
+  std::vector<SymbolPosting> postings;
+  std::vector<u8> names;
+  std::string prev;
+  while (!heap.empty()) {
+    auto cursor = heap.top();
+    heap.pop();
+    auto& entry = runs[cursor.first][cursor.second];
+    if (ranges.empty() || entry.name != prev) {
+      size_t shared = 0;
+      if (ranges.size() % symdb_block_size == 0) {
+        blocks.push_back(static_cast<u32>(names.size()));
+      } else {
+        size_t max = std::min(prev.size(), entry.name.size());
+        while (shared < max && prev[shared] == entry.name[shared]) {
+          shared++;
+        }
+        PutUleb(shared, &names);
+      }
+      PutUleb(entry.name.size() - shared, &names);
+      names.insert(names.end(), entry.name.begin() + shared,
+                   entry.name.end());
+      ranges.push_back(static_cast<u32>(postings.size()));
+      prev = std::move(entry.name);
+    }
+    postings.push_back(entry.posting);
+    if (++cursor.second < runs[cursor.first].size()) {
+      heap.push(cursor);
+    } else {
+      SymbolRun().swap(runs[cursor.first]);
+    }
+  }
+  u32 num_names = static_cast<u32>(ranges.size());
+  ranges.push_back(static_cast<u32>(postings.size()));
+
+  SymbolDbHeader header{};
+  memcpy(header.magic, symdb_magic, sizeof(header.magic));
+  header.num_names = num_names;
+  header.num_blocks = static_cast<u32>(blocks.size());
+  header.num_postings = static_cast<u32>(postings.size());
+  header.num_modules = static_cast<u32>(modules.size());
+  out->assign(sizeof(header), 0);
+  header.blocks_offset = out->size();
+  Append(blocks, out);
+  header.ranges_offset = out->size();
+  Append(ranges, out);
+  header.postings_offset = out->size();
+  Append(postings, out);
+  header.modules_offset = out->size();
+  Append(modules, out);
+  header.names_offset = out->size();
+  header.names_size = names.size();
+  Append(names, out);
+  header.strings_offset = out->size();
+  header.strings_size = strings.size();
+  Append(strings, out);
+  memcpy(out->data(), &header, sizeof(header));
+  return true;
+}
@@ -0,0 +1,201 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "types.h"
+
+// Where a name appears: exported at |address| or imported by |module|.
+struct SymbolPosting {
+  u64 address;
+  u32 module;
+  u8 import;
+  // st_info of the dynamic symbol
+  u8 info;
+  u16 reserved;
+};
+
+struct SymbolDbModule {
+  // Offsets into the string pool
+  u32 title;
+  u32 name;
+};
+
+// Global symbol database over every .dynsym name (imports and exports) of an
+// archive of modules. Names are sorted and front coded in blocks, so a lookup
+// is a binary search over the block heads plus decoding one or two blocks.
+//
+// File layout (little endian), suitable for mmap:
+//   SymbolDbHeader
+//   u32 blocks[num_blocks]         offset of each block in the name data
+//   u32 ranges[num_names + 1]      postings of name i are
+//                                  [ranges[i], ranges[i+1])
+//   SymbolPosting postings[num_postings]  sorted by (name, module, address)
+//   SymbolDbModule modules[num_modules]
+//   name data, then the NUL terminated title and module names
+//
+// Each block holds up to symdb_block_size names. The first is stored as
+// uleb128 length and bytes; the others as uleb128 length shared with the
+// previous name, uleb128 suffix length and the suffix.
+struct SymbolDbHeader {
+  char magic[8];
+  u32 num_names;
+  u32 num_blocks;
+  u32 num_postings;
+  u32 num_modules;
+  u64 blocks_offset;
+  u64 ranges_offset;
+  u64 postings_offset;
+  u64 modules_offset;
+  u64 names_offset;
+  u64 names_size;
+  u64 strings_offset;
+  u64 strings_size;
+};
+inline constexpr char symdb_magic[8] = {'N', 'X', 'S', 'Y',
+                                        'M', 'D', 'B', '1'};
+inline constexpr u32 symdb_block_size = 16;
+
+struct SymbolDbView {
+  // Wraps a serialized database; |data| must stay valid and 8 byte aligned.
+  bool Parse(const void* data, size_t size) {
+    if (size < sizeof(SymbolDbHeader)) {
+      return false;
+    }
+    auto header = static_cast<const SymbolDbHeader*>(data);
+    auto fits = [size](u64 offset, u64 count, u64 elem_size) {
+      return offset <= size && count <= (size - offset) / elem_size;
+    };
+    if (memcmp(header->magic, symdb_magic, sizeof(header->magic)) ||
+        header->num_blocks !=
+            (u64(header->num_names) + symdb_block_size - 1) /
+                symdb_block_size ||
+        !fits(header->blocks_offset, header->num_blocks, sizeof(u32)) ||
+        !fits(header->ranges_offset, u64(header->num_names) + 1,
+              sizeof(u32)) ||
+        !fits(header->postings_offset, header->num_postings,
+              sizeof(SymbolPosting)) ||
+        !fits(header->modules_offset, header->num_modules,
+              sizeof(SymbolDbModule)) ||
+        !fits(header->names_offset, header->names_size, 1) ||
+        !fits(header->strings_offset, header->strings_size, 1) ||
+        (header->strings_size &&
+         static_cast<const u8*>(data)[header->strings_offset +
+                                      header->strings_size - 1])) {
+      return false;
+    }
+    auto base = static_cast<const u8*>(data);
+    this->header = header;
+    blocks = reinterpret_cast<const u32*>(base + header->blocks_offset);
+    ranges = reinterpret_cast<const u32*>(base + header->ranges_offset);
+    postings =
+        reinterpret_cast<const SymbolPosting*>(base + header->postings_offset);
+    modules =
+        reinterpret_cast<const SymbolDbModule*>(base + header->modules_offset);
+    names = base + header->names_offset;
+    strings = reinterpret_cast<const char*>(base + header->strings_offset);
+    return true;
+  }
+
+  // Calls func(name, first, last) with the postings of |key|, or of every
+  // name starting with |key| if |prefix|, in name order.
+  template <typename F>
+  void Find(const std::string& key, bool prefix, F func) const {
+    // The last block whose head is below key holds the first candidate
+    u32 lo = 0, hi = header->num_blocks;
+    std::string name;
+    while (lo < hi) {
+      u32 mid = lo + (hi - lo) / 2;
+      BlockReader r(*this, mid);
+      if (r.Next(&name) && name < key) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    for (u32 block = lo ? lo - 1 : 0; block < header->num_blocks; block++) {
+      BlockReader r(*this, block);
+      for (u32 i = block * symdb_block_size; r.Next(&name); i++) {
+        if (name < key) {
+          continue;
+        }
+        if (prefix ? name.compare(0, key.size(), key) : name != key) {
+          return;
+        }
+        u32 first = ranges[i], last = ranges[i + 1];
+        if (first > last || last > header->num_postings) {
+          return;
+        }
+        func(name, &postings[first], &postings[last]);
+      }
+    }
+  }
+  const char* String(u32 offset) const {
+    return offset < header->strings_size ? &strings[offset] : "";
+  }
+
+  const SymbolDbHeader* header{};
+  const u32* blocks{};
+  const u32* ranges{};
+  const SymbolPosting* postings{};
+  const SymbolDbModule* modules{};
+  const u8* names{};
+  const char* strings{};
+
+ private:
+  // Decodes the names of one block; Next fails at its end or on bad data.
+  struct BlockReader {
+    BlockReader(const SymbolDbView& db, u32 block)
+        : pos(db.blocks[block]),
+          end(db.header->names_size),
+          names(db.names),
+          left(std::min(symdb_block_size,
+                        db.header->num_names - block * symdb_block_size)) {}
+    bool Next(std::string* name) {
+      if (!left) {
+        return false;
+      }
+      u64 shared = first ? 0 : Uleb();
+      u64 len = Uleb();
+      if (pos > end || shared > name->size() || len > end - pos) {
+        left = 0;
+        return false;
+      }
+      name->resize(shared);
+      name->append(reinterpret_cast<const char*>(&names[pos]), len);
+      pos += len;
+      first = false;
+      left--;
+      return true;
+    }
+    u64 Uleb() {
+      u64 val = 0;
+      for (int shift = 0; pos < end && shift < 64; shift += 7) {
+        u8 b = names[pos++];
+        val |= static_cast<u64>(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+          return val;
+        }
+      }
+      // Truncated: make the caller's bounds check fail
+      pos = end + 1;
+      return 0;
+    }
+
+    u64 pos;
+    u64 end;
+    const u8* names;
+    u32 left;
+    bool first{true};
+  };
+};
+
+// Builds the database over every module below |root|. A module's title is
+// its directory relative to |root|. Modules are read on up to |jobs| threads
+// and their sorted names are merged.
+bool BuildSymbolDb(const std::filesystem::path& root,
+                   unsigned jobs,
+                   std::vector<u8>* out);
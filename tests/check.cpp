@@ -0,0 +1,149 @@
+// Checks run against a real module: make check INPUT=<nso, nro or elf>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <exception>
+#include <future>
+#include <vector>
+
+#include "../analysis.h"
+#include "../async.h"
+#include "../nso.h"
+
+namespace {
+
+int failures = 0;
+
+#define CHECK(cond)                                                    \
+  do {                                                                 \
+    if (!(cond)) {                                                     \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+              #cond);                                                  \
+      failures++;                                                      \
+    }                                                                  \
+  } while (0)
+
+bool SameApiInfo(const NsoFile& a, const NsoFile& b) {
+  auto x = a.ApiInfo(), y = b.ApiInfo();
+  if (x.size() != y.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < x.size(); i++) {
+    if (x[i].kind != y[i].kind || x[i].vendor != y[i].vendor ||
+        x[i].name != y[i].name) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Converting an exported ELF again gives the same bytes, .api_info included
+void CheckElfRoundTrip(NsoFile& nso) {
+  std::vector<u8> elf;
+  nso.BuildElf(&elf);
+  NsoFile again;
+  CHECK(again.Load(elf));
+  CHECK(again.HasApiInfo() == nso.HasApiInfo());
+  CHECK(SameApiInfo(again, nso));
+  std::vector<u8> elf_again;
+  again.BuildElf(&elf_again);
+  CHECK(elf_again == elf);
+}
+
+// What AsyncWriteElf writes
+std::vector<u8> BuildWithPasses(NsoFile& nso) {
+  PassResults passes;
+  if (!PassRegistry::Get().passes.empty()) {
+    PassRegistry::Get().Run(nso.GetView(), 1, &passes);
+  }
+  std::vector<u8> elf;
+  nso.BuildElf(&elf, &passes);
+  return elf;
+}
+
+AsyncSink VectorSink(std::vector<u8>* out) {
+  return [out](const u8* data, size_t size) {
+    out->insert(out->end(), data, data + size);
+    return true;
+  };
+}
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+// Starts at once and is not awaited; |done| reports the result
+struct Task {
+  struct promise_type {
+    Task get_return_object() { return {}; }
+    std::suspend_never initial_suspend() { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+};
+
+Task LoadAndWrite(AsyncContext context,
+                  int fd,
+                  std::vector<u8>* elf,
+                  std::promise<bool>* done) {
+  auto nso = co_await nx::load(context, fd);
+  bool ok = nso && co_await nso.write_elf(VectorSink(elf));
+  done->set_value(ok);
+}
+#endif
+
+// A load and a write through the executors give what the blocking calls do
+void CheckAsync(const char* path, NsoFile& nso) {
+  // libnx2elf.a keeps the self registering passes when linked whole
+  CHECK(!PassRegistry::Get().passes.empty());
+  auto expected = BuildWithPasses(nso);
+
+  ThreadPool io(2), cpu(2);
+  AsyncContext context{&io, &cpu};
+  int fd = open(path, O_RDONLY);
+  CHECK(fd >= 0);
+  std::promise<std::shared_ptr<NsoFile>> loaded;
+  AsyncLoad(context, fd, [&loaded](std::unique_ptr<NsoFile> result) {
+    loaded.set_value(std::move(result));
+  });
+  auto loaded_nso = loaded.get_future().get();
+  close(fd);
+  CHECK(loaded_nso && loaded_nso->image == nso.image);
+  if (!loaded_nso) {
+    return;
+  }
+  std::vector<u8> elf;
+  std::promise<bool> written;
+  AsyncWriteElf(context, loaded_nso, VectorSink(&elf),
+                [&written](bool ok) { written.set_value(ok); });
+  CHECK(written.get_future().get());
+  CHECK(elf == expected);
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+  fd = open(path, O_RDONLY);
+  std::vector<u8> coroutine_elf;
+  std::promise<bool> done;
+  LoadAndWrite(context, fd, &coroutine_elf, &done);
+  CHECK(done.get_future().get());
+  close(fd);
+  CHECK(coroutine_elf == expected);
+#endif
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  if (argc != 2) {
+    fputs("usage: check <nso, nro or elf>\n", stderr);
+    return 2;
+  }
+  NsoFile nso;
+  if (!nso.Load(argv[1])) {
+    return 2;
+  }
+  CheckAsync(argv[1], nso);
+  CheckElfRoundTrip(nso);
+  if (!failures) {
+    printf("%s: ok\n", argv[1]);
+  }
+  return failures ? 1 : 0;
+}
@@ -4,6 +4,7 @@
 #include <array>
 #include <cstring>
 #include <memory>
+#include <vector>
 
 typedef uint8_t u8;
 typedef uint16_t u16;
@@ -57,9 +58,44 @@ inline void* memmem_m(const void* haystack,
                       const void* needle,
                       const void* mask,
                       size_t needle_len) {
+  if (haystack_len < needle_len) {
+    return nullptr;
+  }
+  const u8* n = (const u8*)needle;
+  const u8* m = (const u8*)mask;
+  // Anchor on a fully-masked byte so memchr (vectorized by libc) can skip
+  // over non-candidates. Prefer a byte which isn't 0x00/0xff since those are
+  // everywhere in code and data.
+  size_t anchor = needle_len;
+  for (size_t i = 0; i < needle_len; i++) {
+    if (m[i] != 0xff) {
+      continue;
+    }
+    if (anchor == needle_len) {
+      anchor = i;
+    }
+    if (n[i] != 0x00 && n[i] != 0xff) {
+      anchor = i;
+      break;
+    }
+  }
   u8* p = (u8*)haystack;
   u8* e = (u8*)haystack + haystack_len - needle_len;
+  if (anchor == needle_len) {
+    while (p <= e) {
+      if (!memcmp_m(p, needle, mask, needle_len)) {
+        return p;
+      }
+      p++;
+    }
+    return nullptr;
+  }
   while (p <= e) {
+    auto a = (u8*)memchr(p + anchor, n[anchor], e - p + 1);
+    if (!a) {
+      return nullptr;
+    }
+    p = a - anchor;
     if (!memcmp_m(p, needle, mask, needle_len)) {
       return p;
     }
@@ -68,6 +104,49 @@ inline void* memmem_m(const void* haystack,
   return nullptr;
 }
 
+// Byte string with per-nibble wildcards, e.g. "f0 7b bf a9 ?? ?? ?? 9?".
+// Bytes are matched in memory order.
+struct BytePattern {
+  bool Parse(const char* str) {
+    bytes.clear();
+    mask.clear();
+    int nibble = 0;
+    u8 b = 0, m = 0;
+    for (; *str; str++) {
+      char c = *str;
+      u8 v, vm = 0xf;
+      if (c == ' ' || c == '\t' || c == ':' || c == ',') {
+        continue;
+      } else if (c >= '0' && c <= '9') {
+        v = c - '0';
+      } else if (c >= 'a' && c <= 'f') {
+        v = c - 'a' + 10;
+      } else if (c >= 'A' && c <= 'F') {
+        v = c - 'A' + 10;
+      } else if (c == '?') {
+        v = vm = 0;
+      } else {
+        return false;
+      }
+      b = (b << 4) | v;
+      m = (m << 4) | vm;
+      if (++nibble == 2) {
+        bytes.push_back(b);
+        mask.push_back(m);
+        nibble = 0;
+      }
+    }
+    return nibble == 0 && !bytes.empty();
+  }
+  size_t size() const { return bytes.size(); }
+  const u8* Find(const void* haystack, size_t len) const {
+    return (const u8*)memmem_m(haystack, len, bytes.data(), mask.data(),
+                               bytes.size());
+  }
+  std::vector<u8> bytes;
+  std::vector<u8> mask;
+};
+
 inline void* memmemr(const void* haystack,
                      size_t haystack_len,
                      const void* needle,
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstring>
+
+#include "types.h"
+
+// XXH64 (https://github.com/Cyan4973/xxHash), bit compatible with the
+// reference implementation on little endian hosts.
+namespace XXH64 {
+
+constexpr u64 kPrime1 = 0x9E3779B185EBCA87ull;
+constexpr u64 kPrime2 = 0xC2B2AE3D27D4EB4Full;
+constexpr u64 kPrime3 = 0x165667B19E3779F9ull;
+constexpr u64 kPrime4 = 0x85EBCA77C2B2AE63ull;
+constexpr u64 kPrime5 = 0x27D4EB2F165667C5ull;
+
+inline u64 Rotl(u64 x, int r) { return (x << r) | (x >> (64 - r)); }
+inline u64 Read64(const u8* p) {
+  u64 v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+inline u32 Read32(const u8* p) {
+  u32 v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+inline u64 Round(u64 acc, u64 input) {
+  acc += input * kPrime2;
+  return Rotl(acc, 31) * kPrime1;
+}
+inline u64 MergeRound(u64 acc, u64 val) {
+  acc ^= Round(0, val);
+  return acc * kPrime1 + kPrime4;
+}
+
+inline u64 Hash(const void* data, size_t len, u64 seed = 0) {
+  auto p = static_cast<const u8*>(data);
+  const u8* end = p + len;
+  u64 h;
+  if (len >= 32) {
+    // Four independent lanes keep the multipliers busy
+    u64 v1 = seed + kPrime1 + kPrime2;
+    u64 v2 = seed + kPrime2;
+    u64 v3 = seed;
+    u64 v4 = seed - kPrime1;
+    const u8* limit = end - 32;
+    do {
+      v1 = Round(v1, Read64(p));
+      v2 = Round(v2, Read64(p + 8));
+      v3 = Round(v3, Read64(p + 16));
+      v4 = Round(v4, Read64(p + 24));
+      p += 32;
+    } while (p <= limit);
+    h = Rotl(v1, 1) + Rotl(v2, 7) + Rotl(v3, 12) + Rotl(v4, 18);
+    h = MergeRound(h, v1);
+    h = MergeRound(h, v2);
+    h = MergeRound(h, v3);
+    h = MergeRound(h, v4);
+  } else {
+    h = seed + kPrime5;
+  }
+  h += len;
+  for (; p + 8 <= end; p += 8) {
+    h ^= Round(0, Read64(p));
+    h = Rotl(h, 27) * kPrime1 + kPrime4;
+  }
+  if (p + 4 <= end) {
+    h ^= Read32(p) * kPrime1;
+    h = Rotl(h, 23) * kPrime2 + kPrime3;
+    p += 4;
+  }
+  for (; p < end; p++) {
+    h ^= *p * kPrime5;
+    h = Rotl(h, 11) * kPrime1;
+  }
+  h ^= h >> 33;
+  h *= kPrime2;
+  h ^= h >> 29;
+  h *= kPrime3;
+  h ^= h >> 32;
+  return h;
+}
+
+}  // namespace XXH64